@@ -27,12 +27,24 @@ FILE *out;
 int flag_debug = 0;
 int flag_verbose = 0;
 int flag_bench = 0;
+int flag_adaptive = 0;
+int flag_labeling = 0;
+int pyramid_level = 0;
+int stream_rows = 0;
+int step_works = 0;
+int track_frames = 0;
+image_format_t view_format = IMAGE_FORMAT_PIXEL;
 double gamma_value = 1.0;
 int eci_code = QR_ECI_CODE_LATIN1;
 
 uint32_t W = 0;
 uint32_t H = 0;
 
+// the rows are detected as they are decoded, in the streaming mode
+qrean_detector_stream_t *stream;
+image_t stream_row;
+struct timeval stream_start;
+
 bit_t write_image_pixel(qrean_t *qrean, bitpos_t x, bitpos_t y, bitpos_t pos, bit_t value, void *opaque)
 {
 	qrean_detector_perspective_t *warp = (qrean_detector_perspective_t *)opaque;
@@ -113,42 +125,184 @@ static void on_found(qrean_detector_perspective_t *warp, void *opaque)
 	fprintf(out, "%s\n", buffer);
 }
 
+// copies the image into a buffer of `format` with the rows padded, to digitize from it as from a caller's buffer
+// the gray ones take the luma by image_monochrome, as is with the gamma 1.0
+static image_view_t copy_image_as(image_t *img, image_format_t format, uint8_t **buffer)
+{
+	*buffer = NULL;
+	if (format == IMAGE_FORMAT_PIXEL) return create_image_view_from_image(img);
+
+	size_t bpp = image_format_get_bytes_per_pixel(format);
+	size_t stride = img->width * bpp + 3; // not aligned
+	*buffer = (uint8_t *)malloc(stride * img->height);
+	image_t *gray = bpp == 1 ? new_image(img->width, img->height) : NULL;
+	if (!*buffer || (bpp == 1 && !gray)) {
+		free(*buffer);
+		*buffer = NULL;
+		if (gray) image_free(gray);
+		return create_image_view_from_image(img);
+	}
+	if (gray) image_monochrome(gray, img, 1.0, NULL);
+
+	for (size_t y = 0; y < img->height; y++) {
+		for (size_t x = 0; x < img->width; x++) {
+			image_pixel_t pix = IMAGE_ROW(gray ? gray : img, y)[x];
+			uint8_t r = PIXEL_GET_R(pix);
+			uint8_t g = PIXEL_GET_G(pix);
+			uint8_t b = PIXEL_GET_B(pix);
+			uint8_t *p = *buffer + y * stride + x * bpp;
+
+			switch (format) {
+			case IMAGE_FORMAT_GRAY8:
+			case IMAGE_FORMAT_YUV_Y:
+				p[0] = r;
+				break;
+			case IMAGE_FORMAT_RGB24:
+			case IMAGE_FORMAT_RGBA32:
+				p[0] = r, p[1] = g, p[2] = b;
+				if (bpp == 4) p[3] = 255;
+				break;
+			case IMAGE_FORMAT_BGRA32:
+				p[0] = b, p[1] = g, p[2] = r, p[3] = 255;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	if (gray) image_free(gray);
+
+	return create_image_view(img->width, img->height, stride, format, *buffer);
+}
+
 void done(pngle_t *pngle)
 {
-	CREATE_IMAGE_BY_CLONE(mono, &image);
+	if (stream) {
+		struct timeval tv;
+		int found = qrean_detector_stream_finish(stream);
+		gettimeofday(&tv, NULL);
+
+		if (flag_bench) {
+			fprintf(stderr, "%.1f ms\n", (tv.tv_sec - stream_start.tv_sec) * 1000.0 + (tv.tv_usec - stream_start.tv_usec) / 1000.0);
+		}
+		if (flag_debug && !found && !stream->found) {
+			fprintf(stderr, "Not found\n");
+		}
+
+		qrean_detector_stream_free(stream);
+		free(stream_row.buffer);
+		return;
+	}
+
+	uint8_t *view_buffer;
+	image_view_t view = copy_image_as(&image, view_format, &view_buffer);
+	CREATE_IMAGE_BITMAP(mono, image.width, image.height);
+	CREATE_QREAN_DETECTOR(detector, image.width, image.height);
+	detector.pyramid_level = pyramid_level;
+
+	struct timeval tv, tv2;
+	int digitized;
+	gettimeofday(&tv, NULL);
+	if (flag_adaptive) {
+		digitized =
+			image_bitmap_digitize_adaptive(&mono, &view, gamma_value, IMAGE_DIGITIZE_ADAPTIVE_WINDOW_AUTO, IMAGE_DIGITIZE_ADAPTIVE_BIAS);
+	} else {
+		digitized = image_bitmap_digitize(&mono, &view, gamma_value);
+	}
+	gettimeofday(&tv2, NULL);
+	free(view_buffer);
+
+	if (!digitized) {
+		fprintf(stderr, "Can't digitize the image\n");
+		DESTROY_QREAN_DETECTOR(detector);
+		DESTROY_IMAGE_BITMAP(mono);
+		return;
+	}
 
-	image_digitize(&mono, &image, gamma_value);
-	// image_morphology_open(mono);
-	// image_morphology_close(mono);
+	if (flag_bench) {
+		fprintf(stderr, "digitize: %.1f ms\n", (tv2.tv_sec - tv.tv_sec) * 1000.0 + (tv2.tv_usec - tv.tv_usec) / 1000.0);
+	}
 
 	int found = 0;
 	int n = flag_bench ? 10 : 1;
+	double scan_ms = 0;
+
+	int steps = 0;
+	double step_ms = 0;
 
-	struct timeval tv, tv2;
 	gettimeofday(&tv, NULL);
 	for (int i = 0; i < n; i++) {
+		struct timeval ts, ts2;
+
+		if (step_works > 0) {
+			detector.use_labeling = flag_labeling;
+			qrean_detector_step_t step = create_qrean_detector_step(&detector, &mono, on_found, NULL);
+			int more;
+			do {
+				gettimeofday(&ts, NULL);
+				more = qrean_detector_step(&step, step_works);
+				gettimeofday(&ts2, NULL);
+
+				double ms = (ts2.tv_sec - ts.tv_sec) * 1000.0 + (ts2.tv_usec - ts.tv_usec) / 1000.0;
+				if (ms > step_ms) step_ms = ms;
+				steps++;
+			} while (more);
+			found += step.found;
+			continue;
+		}
+
+		if (track_frames > 0) {
+			detector.use_labeling = flag_labeling;
+			qrean_detector_tracker_t *tracker = new_qrean_detector_tracker(&detector);
+			if (!tracker) break;
+			for (int frame = 0; frame < track_frames; frame++) {
+				found += qrean_detector_tracker_detect(tracker, &mono, on_found, NULL);
+			}
+			qrean_detector_tracker_free(tracker);
+			continue;
+		}
+
+		gettimeofday(&ts, NULL);
+
 		int num_candidates;
-		qrean_detector_qr_finder_candidate_t *candidates = qrean_detector_scan_qr_finder_pattern(&mono, &num_candidates);
+		qrean_detector_qr_finder_candidate_t *candidates;
+		if (flag_labeling) {
+			candidates = qrean_detector_scan_qr_finder_pattern_by_labeling(&detector, &mono, &num_candidates);
+		} else {
+			candidates = qrean_detector_scan_qr_finder_pattern_bitmap(&detector, &mono, &num_candidates);
+		}
+
+		gettimeofday(&ts2, NULL);
+		scan_ms += (ts2.tv_sec - ts.tv_sec) * 1000.0 + (ts2.tv_usec - ts.tv_usec) / 1000.0;
 
 		if (flag_debug) {
 			// detected = image_clone(&image);
-			detected = image_clone(&mono);
+			detected = new_image(mono.width, mono.height);
+			image_bitmap_unpack(detected, &mono);
 			for (int i = 0; i < num_candidates; i++) {
 				image_draw_filled_ellipse(detected, candidates[i].center, 5, 5, PIXEL(255, 0, 0));
 				image_draw_extent(detected, candidates[i].extent, PIXEL(255, 0, 0), 1);
 			}
 		}
 
-		found += qrean_detector_try_decode_qr(&mono, candidates, num_candidates, on_found, NULL);
-		found += qrean_detector_try_decode_mqr(&mono, candidates, num_candidates, on_found, NULL);
-		found += qrean_detector_try_decode_rmqr(&mono, candidates, num_candidates, on_found, NULL);
-		found += qrean_detector_try_decode_tqr(&mono, candidates, num_candidates, on_found, NULL);
+		qrean_detector_classify_candidates(&detector, &mono, candidates, num_candidates);
 
-		found += qrean_detector_scan_barcodes(&mono, on_found, NULL);
+		found += qrean_detector_try_decode_qr_bitmap(&detector, &mono, candidates, num_candidates, on_found, NULL);
+		found += qrean_detector_try_decode_mqr_bitmap(&detector, &mono, candidates, num_candidates, on_found, NULL);
+		found += qrean_detector_try_decode_rmqr_bitmap(&detector, &mono, candidates, num_candidates, on_found, NULL);
+		found += qrean_detector_try_decode_tqr_bitmap(&detector, &mono, candidates, num_candidates, on_found, NULL);
+
+		found += qrean_detector_scan_barcodes_bitmap(&detector, &mono, on_found, NULL);
 	}
 	gettimeofday(&tv2, NULL);
 
-	if (flag_bench) {
+	if (flag_bench && step_works > 0) {
+		fprintf(stderr, "%d steps, longest: %.2f ms\n", steps / n, step_ms);
+	} else if (flag_bench && track_frames > 0) {
+		double ms = (tv2.tv_sec - tv.tv_sec) * 1000.0 + (tv2.tv_usec - tv.tv_usec) / 1000.0;
+		fprintf(stderr, "%.2f ms per frame\n", ms / n / track_frames);
+	} else if (flag_bench) {
+		fprintf(stderr, "scan: %.2f ms\n", scan_ms / n);
 		fprintf(stderr, "%.1f ms\n", ((tv2.tv_sec - tv.tv_sec) * 1000.0 + (tv2.tv_usec - tv.tv_usec) / 1000.0) / n);
 	}
 
@@ -157,7 +311,8 @@ void done(pngle_t *pngle)
 	}
 	if (debug_out) image_save_as_png(detected, debug_out);
 
-	DESTROY_IMAGE(mono);
+	DESTROY_QREAN_DETECTOR(detector);
+	DESTROY_IMAGE_BITMAP(mono);
 }
 
 void draw_pixel(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h, const uint8_t rgba[4])
@@ -166,6 +321,15 @@ void draw_pixel(pngle_t *pngle, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
 	uint8_t g = rgba[1];
 	uint8_t b = rgba[2];
 
+	if (stream) {
+		image_draw_pixel(&stream_row, POINT(x, 0), PIXEL(r, g, b));
+		if (x + w >= W) {
+			image_view_t view = create_image_view_from_image(&stream_row);
+			qrean_detector_stream_push_rows(stream, &view);
+		}
+		return;
+	}
+
 	image_draw_pixel(&image, POINT(x, y), PIXEL(r, g, b));
 }
 
@@ -174,6 +338,22 @@ void init_screen(pngle_t *pngle, uint32_t w, uint32_t h)
 	W = w;
 	H = h;
 
+	if (stream_rows > 0) {
+		// the interlaced ones come in the passes, not in the rows
+		if (pngle_get_ihdr(pngle)->interlace) {
+			fprintf(stderr, "Interlaced PNG can't be streamed, detecting as a whole\n");
+		} else {
+			gettimeofday(&stream_start, NULL);
+			stream = new_qrean_detector_stream(W, stream_rows, gamma_value, on_found, NULL);
+			image_init(&stream_row, W, 1, calloc(W, sizeof(image_pixel_t)));
+			if (stream && stream_row.buffer) return;
+
+			qrean_detector_stream_free(stream);
+			free(stream_row.buffer);
+			stream = NULL;
+		}
+	}
+
 	image_init(&image, W, H, calloc(W * H, sizeof(image_pixel_t)));
 }
 
@@ -198,6 +378,14 @@ int usage(FILE *out)
 	fprintf(out, "\n");
 	fprintf(out, "  Image processing options:\n");
 	fprintf(out, "    -g GAMMA          Set gamma value (default: 1.8)\n");
+	fprintf(out, "    -A                Use adaptive (local) thresholding\n");
+	fprintf(out, "    -L                Use connected component labeling to find finder patterns\n");
+	fprintf(out, "    -P LEVEL          Find finder patterns on the image downscaled by 2^LEVEL at most (0-%d, -1: auto)\n",
+		QREAN_DETECTOR_PYRAMID_MAX_LEVEL);
+	fprintf(out, "    -s ROWS           Detect while decoding, keeping ROWS rows (adaptive, for symbols up to ROWS/2 tall)\n");
+	fprintf(out, "    -W WORKS          Detect in steps of WORKS rows or tries each\n");
+	fprintf(out, "    -T FRAMES         Track the symbols over FRAMES frames of the same image, as a video\n");
+	fprintf(out, "    -F FORMAT         Digitize from a copy in FORMAT with the rows padded (gray8, rgb24, rgba32, bgra32, yuv-y)\n");
 	fprintf(out, "\n");
 	fprintf(out, "  ECI options:\n");
 	fprintf(out, "    -E CODE           Set initial ECI code\n");
@@ -222,7 +410,7 @@ int main(int argc, char *argv[])
 	int len;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "hVo:g:DO:vBUSE:")) != -1) {
+	while ((ch = getopt(argc, argv, "hVo:g:ALP:s:W:T:F:DO:vBUSE:")) != -1) {
 		switch (ch) {
 		case 'h':
 			return usage(stdout);
@@ -243,6 +431,51 @@ int main(int argc, char *argv[])
 			gamma_value = atof(optarg);
 			break;
 
+		case 'A':
+			flag_adaptive = 1;
+			break;
+
+		case 'L':
+			flag_labeling = 1;
+			break;
+
+		case 'P':
+			pyramid_level = atoi(optarg);
+			if (pyramid_level < QREAN_DETECTOR_PYRAMID_AUTO || pyramid_level > QREAN_DETECTOR_PYRAMID_MAX_LEVEL) {
+				fprintf(stderr, "Invalid pyramid level: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 's':
+			stream_rows = atoi(optarg);
+			break;
+
+		case 'W':
+			step_works = atoi(optarg);
+			break;
+
+		case 'T':
+			track_frames = atoi(optarg);
+			break;
+
+		case 'F':
+			if (!strcmp(optarg, "gray8")) {
+				view_format = IMAGE_FORMAT_GRAY8;
+			} else if (!strcmp(optarg, "rgb24")) {
+				view_format = IMAGE_FORMAT_RGB24;
+			} else if (!strcmp(optarg, "rgba32")) {
+				view_format = IMAGE_FORMAT_RGBA32;
+			} else if (!strcmp(optarg, "bgra32")) {
+				view_format = IMAGE_FORMAT_BGRA32;
+			} else if (!strcmp(optarg, "yuv-y")) {
+				view_format = IMAGE_FORMAT_YUV_Y;
+			} else {
+				fprintf(stderr, "Unknown format '%s' is specified\n", optarg);
+				return 1;
+			}
+			break;
+
 		case 'D':
 			flag_debug = 1;
 			qrean_on_debug_vprintf(vfprintf, stderr);
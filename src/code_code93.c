@@ -96,11 +96,13 @@ size_t qrean_read_code93_string(qrean_t *qrean, void *buf, size_t size)
 	}
 
 	if (bitstream_read_bit(&bs) == 0) return 0; // Termination bar
+	if (len < 3) return 0; // a character and the check characters at least
 
 	int C = 0, K = 0;
 	int w = (len - 1);
 	for (size_t i = 0; i < len - 2; i++) {
 		int n = dst[i];
+		if (n >= (int)strlen(symbol_lookup)) return 0; // the shifts of the full ASCII
 		C = (C + n * ((w + 0) % 20 + 1)) % 47;
 		K = (K + n * ((w + 1) % 15 + 1)) % 47;
 
@@ -12,7 +12,12 @@ static void *qrean_debug_vprintf_opaque = NULL;
 #endif
 static void (*qrean_error_cb)(const char *message);
 
-const char *qrean_last_error = NULL;
+// the last error is per thread, if the compiler can
+#if !defined(NO_THREAD_LOCAL) && defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+static _Thread_local const char *qrean_last_error = NULL;
+#else
+static const char *qrean_last_error = NULL;
+#endif
 
 #ifndef NO_PRINTF
 int safe_vfprintf(FILE *fp, const char *fmt, va_list ap)
@@ -61,6 +66,14 @@ int qrean_debug_printf(const char *fmt, ...)
 	return retval;
 }
 
+int qrean_debug_vprintf(const char *fmt, va_list ap)
+{
+#ifndef NO_DEBUG
+	if (qrean_debug_vprintf_cb) return qrean_debug_vprintf_cb(qrean_debug_vprintf_opaque, fmt, ap);
+#endif
+	return 0;
+}
+
 void qrean_on_debug_vprintf(int (*vfprintf_like)(void *opaque, const char *fmt, va_list ap), void *opaque)
 {
 #ifndef NO_DEBUG
@@ -1,11 +1,13 @@
 #ifndef __QR_DEBUG_H__
 #define __QR_DEBUG_H__
 
+#include <stdarg.h>
 #include <stdio.h>
 
 #define QREAN_BANNER "[libqrean] "
 
 int qrean_debug_printf(const char *fmt, ...);
+int qrean_debug_vprintf(const char *fmt, va_list ap);
 void qrean_error(const char *message);
 
 void qrean_on_debug_vprintf(int (*vprintf_like)(), void *opaque);
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "detector.h"
@@ -8,38 +9,383 @@
 #include "runlength.h"
 #include "utils.h"
 
-// #define BARCODE_DETECTION_METHOD_2
+// against the squared width of a finder pattern, the ring is about 0.5 of it
+#define FINDER_PATTERN_MAX_AREA_RATIO (4)
+
+qrean_detector_scratch_t create_qrean_detector_scratch(size_t width, size_t height, void *visited_buffer, void *painted_buffer)
+{
+	qrean_detector_scratch_t scratch = {
+		.width = width,
+		.height = height,
+		.visited = create_image_bitmap(width, height, visited_buffer),
+		.painted = create_image_bitmap(width, height, painted_buffer),
+	};
+#ifndef NO_MALLOC
+	scratch.stack.growable = 1;
+	scratch.rows = (size_t *)malloc((height + 1) * sizeof(size_t));
+#endif
+	return scratch;
+}
+
+void qrean_detector_scratch_deinit(qrean_detector_scratch_t *scratch)
+{
+#ifndef NO_MALLOC
+	free(scratch->stack.spans);
+	free(scratch->runs);
+	free(scratch->components);
+	free(scratch->rows);
+	free(scratch->candidates);
+	free(scratch->grid);
+	free(scratch->pyramid);
+	free(scratch->edges);
+#endif
+}
+
+qrean_detector_t create_qrean_detector(size_t width, size_t height, void *visited_buffer, void *painted_buffer)
+{
+	qrean_detector_t detector = {
+		.scratch = create_qrean_detector_scratch(width, height, visited_buffer, painted_buffer),
+		.scan_barcodes = 1,
+	};
+	detector.candidates[0].center = POINT(NAN, NAN);
+	return detector;
+}
+
+void qrean_detector_deinit(qrean_detector_t *detector)
+{
+	qrean_detector_scratch_deinit(&detector->scratch);
+}
+
+void qrean_detector_set_labeling_buffer(qrean_detector_t *detector, void *buffer, size_t size)
+{
+#ifdef NO_MALLOC
+	qrean_detector_scratch_t *scratch = &detector->scratch;
+	size_t rows_size = (scratch->height + 1) * sizeof(size_t);
+	size_t item_size = sizeof(qrean_detector_labeling_component_t) + sizeof(qrean_detector_labeling_run_t);
+	size_t n = size > rows_size ? (size - rows_size) / item_size : 0;
+
+	// the components first, to keep them aligned
+	scratch->rows = n ? (size_t *)buffer : NULL;
+	scratch->components = (qrean_detector_labeling_component_t *)((uint8_t *)buffer + rows_size);
+	scratch->max_components = n;
+	scratch->runs = (qrean_detector_labeling_run_t *)(scratch->components + n);
+	scratch->max_runs = n;
+#else
+	(void)detector;
+	(void)buffer;
+	(void)size;
+#endif
+}
+
+qrean_detector_t *new_qrean_detector(size_t width, size_t height)
+{
+#ifndef NO_MALLOC
+	qrean_detector_t *detector = (qrean_detector_t *)malloc(sizeof(qrean_detector_t));
+	if (!detector) return NULL;
+
+	void *visited = new_image_bitmap_buffer(width, height);
+	void *painted = new_image_bitmap_buffer(width, height);
+	*detector = create_qrean_detector(width, height, visited, painted);
+	if (!visited || !painted || !detector->scratch.rows) {
+		qrean_detector_free(detector);
+		return NULL;
+	}
+
+	return detector;
+#else
+	return NULL;
+#endif
+}
+
+void qrean_detector_free(qrean_detector_t *detector)
+{
+#ifndef NO_MALLOC
+	if (!detector) return;
+	qrean_detector_deinit(detector);
+	image_bitmap_buffer_free(detector->scratch.visited.buffer);
+	image_bitmap_buffer_free(detector->scratch.painted.buffer);
+	free(detector);
+#endif
+}
+
+void qrean_detector_on_debug_vprintf(
+	qrean_detector_t *detector, int (*vprintf_like)(void *opaque, const char *fmt, va_list ap), void *opaque)
+{
+#ifndef NO_DEBUG
+	detector->debug_vprintf = vprintf_like;
+	detector->debug_opaque = opaque;
+#endif
+}
+
+static int detector_debug_printf(qrean_detector_t *detector, const char *fmt, ...)
+{
+	int retval = 0;
+
+#ifndef NO_DEBUG
+	va_list ap;
+	va_start(ap, fmt);
+	if (detector->debug_vprintf) {
+		retval = detector->debug_vprintf(detector->debug_opaque, fmt, ap);
+	} else {
+		retval = qrean_debug_vprintf(fmt, ap);
+	}
+	va_end(ap);
+#endif
+
+	return retval;
+}
+
+static int scratch_fits(qrean_detector_t *detector, image_bitmap_t *src)
+{
+	if (detector->scratch.width == src->width && detector->scratch.height == src->height) return 1;
+	detector_debug_printf(detector, "scratch doesn't fit the image\n");
+	return 0;
+}
+
+// NULL for the default stack, if it can't grow
+static image_paint_stack_t *scratch_stack(qrean_detector_scratch_t *scratch)
+{
+	return scratch->stack.growable ? &scratch->stack : NULL;
+}
+
+// grows the buffer to have more than `num` elements, doubling from `initial`
+static int scratch_reserve(void **ptr, size_t *max, size_t num, size_t size, size_t initial)
+{
+	if (num < *max) return 1;
+#ifndef NO_MALLOC
+	size_t n = *max ? *max * 2 : initial;
+	while (n <= num) n *= 2;
+	void *p = realloc(*ptr, n * size);
+	if (!p) return 0;
+	*ptr = p;
+	*max = n;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+// the candidates grow on the scratch, or the fixed ones are used if they can't
+// returns the slot of the candidate `idx`, with a room for the guardian after it, or NULL if full
+static qrean_detector_qr_finder_candidate_t *candidate_slot(qrean_detector_t *detector, int idx)
+{
+	qrean_detector_scratch_t *scratch = &detector->scratch;
+	size_t size = sizeof(qrean_detector_qr_finder_candidate_t);
+	if (scratch_reserve((void **)&scratch->candidates, &scratch->max_candidates, idx + 1, size, MAX_CANDIDATES + 1)) {
+		return &scratch->candidates[idx];
+	}
+	if (!scratch->candidates && idx < MAX_CANDIDATES) return &detector->candidates[idx];
+	return NULL;
+}
+
+static qrean_detector_qr_finder_candidate_t *candidate_list(qrean_detector_t *detector)
+{
+	return detector->scratch.candidates ? detector->scratch.candidates : detector->candidates;
+}
+
+// pixel classes for the runlength, the visited pixels are never taken as dark nor light
+#define PIXEL_CLASS_DARK    (0)
+#define PIXEL_CLASS_LIGHT   (1)
+#define PIXEL_CLASS_VISITED (2)
+
+static int is_inside(image_bitmap_t *img, image_point_t p)
+{
+	int x = round(POINT_X(p));
+	int y = round(POINT_Y(p));
+	return 0 <= x && x < (int)img->width && 0 <= y && y < (int)img->height;
+}
+
+// out of the image is taken as dark, just like image_read_pixel() returns black
+static bit_t read_dark_pixel(image_bitmap_t *img, image_point_t p)
+{
+	return is_inside(img, p) ? image_bitmap_read_pixel(img, p) : 1;
+}
+
+// for the row scans, which validate the bounds by themselves
+static int read_pixel_class_unchecked(image_bitmap_t *img, image_bitmap_t *visited, int x, int y)
+{
+	if (visited && IMAGE_BITMAP_READ_PIXEL(visited, x, y)) return PIXEL_CLASS_VISITED;
+	return IMAGE_BITMAP_READ_PIXEL(img, x, y) ? PIXEL_CLASS_DARK : PIXEL_CLASS_LIGHT;
+}
+
+static int read_pixel_class_at(image_bitmap_t *img, image_bitmap_t *visited, int x, int y)
+{
+	if (x < 0 || y < 0 || x >= (int)img->width || y >= (int)img->height) return PIXEL_CLASS_DARK;
+	return read_pixel_class_unchecked(img, visited, x, y);
+}
+
+static int read_pixel_class(image_bitmap_t *img, image_bitmap_t *visited, image_point_t p)
+{
+	return read_pixel_class_at(img, visited, round(POINT_X(p)), round(POINT_Y(p)));
+}
+
+// same as runlength_init() for each visited pixel
+static void skip_visited_pixels(runlength_t *rl, int n)
+{
+	for (int i = 0; i < n && i < MAX_RUNLENGTH / 2; i++) {
+		runlength_init(rl);
+	}
+}
 
 bit_t qrean_detector_perspective_read_image_pixel(qrean_t *qrean, bitpos_t x, bitpos_t y, bitpos_t pos, void *opaque)
 {
 	qrean_detector_perspective_t *warp = (qrean_detector_perspective_t *)opaque;
 
-	uint32_t pix = image_read_pixel(warp->img, image_point_transform(POINT(x, y), warp->h)) & 0xFFFFFF;
-
-	return pix == 0 ? 1 : 0;
+	return read_dark_pixel(warp->img, image_point_transform(POINT(x, y), warp->h));
 }
 
 bit_t qrean_detector_perspective_write_image_pixel(qrean_t *qrean, bitpos_t x, bitpos_t y, bitpos_t pos, bit_t v, void *opaque)
 {
 	qrean_detector_perspective_t *warp = (qrean_detector_perspective_t *)opaque;
 
-	image_draw_pixel(warp->img, image_point_transform(POINT(x, y), warp->h), v ? PIXEL(0, 0, 0) : PIXEL(255, 255, 255));
+	image_bitmap_draw_pixel(warp->img, image_point_transform(POINT(x, y), warp->h), v);
 	return 0;
 }
 
-static int scan_barcode(runlength_t *rl, image_t *img, image_t *src, int x, int y, int dx, int dy,
-	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+void qrean_detector_perspective_sample(qrean_detector_perspective_t *warp)
 {
-	uint32_t v = image_read_pixel(img, POINT(x, y));
-	if (v != 0 && v != PIXEL(255, 255, 255)) {
-		runlength_init(rl);
-		return 0;
+#ifndef NO_CANVAS_BUFFER
+	qrean_t *qrean = warp->qrean;
+
+	// detach first, to write into the canvas buffer
+	qrean_on_read_pixel(qrean, NULL, NULL);
+	qrean_on_write_pixel(qrean, NULL, NULL);
+
+	for (int y = 0; y < qrean->canvas.symbol_height; y++) {
+		image_transform_iterator_t it = create_image_transform_iterator(warp->h, POINT(0, y), POINT(1, 0));
+		int x = 0;
+		for (; x + IMAGE_TRANSFORM_ITERATOR_LANES <= qrean->canvas.symbol_width; x += IMAGE_TRANSFORM_ITERATOR_LANES) {
+			image_point_t points[IMAGE_TRANSFORM_ITERATOR_LANES];
+			image_transform_iterator_next_lanes(&it, points);
+			for (int i = 0; i < IMAGE_TRANSFORM_ITERATOR_LANES; i++) qrean_write_pixel(qrean, x + i, y, read_dark_pixel(warp->img, points[i]));
+		}
+		for (; x < qrean->canvas.symbol_width; x++) {
+			qrean_write_pixel(qrean, x, y, read_dark_pixel(warp->img, image_transform_iterator_next(&it)));
+		}
+	}
+#endif
+}
+
+// barcodes are at most 255 modules wide, and a run is a module at least
+#define BARCODE_LINE_MODULES (256)
+#define BARCODE_MAX_RUNS     (BARCODE_LINE_MODULES)
+#define BARCODE_CHAR_RUNS    (9) // CODE39
+
+#define BARCODE_QUIET_ZONE     (10) // in the narrow bars, after the stop pattern
+#define BARCODE_EAN_QUIET_ZONE (7) // EAN-8 and the right side of EAN-13
+#define BARCODE_LEAD_IN        (2) // in the narrow bars, before the start pattern
+#define BARCODE_WIDE           (3) // in the modules, as the decoders read
+#define BARCODE_LINE_STEP      (10) // XXX: reduce CPU time...
+
+static bit_t read_barcode_line_pixel(qrean_t *qrean, bitpos_t x, bitpos_t y, bitpos_t pos, void *opaque)
+{
+	return x < BARCODE_LINE_MODULES ? READ_BIT(opaque, x) : 1;
+}
+
+// the runs on a scanline, as the positions of the edges from the start of the line
+// the even runs are light and the odd ones are dark, so that they are the same if reversed
+typedef struct {
+	int *edges;
+	int num_runs;
+
+	int x, y; // the start of the line
+	int dx, dy;
+	int length;
+	int reversed; // the runs are read from the end of the line
+} barcode_runs_t;
+
+static runlength_count_t barcode_run(barcode_runs_t *runs, int i)
+{
+	if (runs->reversed) i = runs->num_runs - 1 - i;
+	return runs->edges[i + 1] - runs->edges[i];
+}
+
+// the start of the run `i`, from the start of the line in the direction of the runs
+static int barcode_run_pos(barcode_runs_t *runs, int i)
+{
+	return runs->reversed ? runs->length - runs->edges[runs->num_runs - i] : runs->edges[i];
+}
+
+// the pixel at `pos` from the start of the line in the direction of the runs
+static void barcode_run_pixel(barcode_runs_t *runs, int pos, int *x, int *y)
+{
+	if (runs->reversed) pos = runs->length - 1 - pos;
+	*x = runs->x + pos * runs->dx;
+	*y = runs->y + pos * runs->dy;
+}
+
+static void barcode_widths(barcode_runs_t *runs, int i, int n, runlength_count_t *widths)
+{
+	for (int k = 0; k < n; k++) widths[k] = barcode_run(runs, i + k);
+}
+
+// collects the runs on the line at once, the visited pixels are taken as light
+static void collect_barcode_runs(qrean_detector_t *detector, image_bitmap_t *img, barcode_runs_t *runs)
+{
+	qrean_detector_scratch_t *scratch = &detector->scratch;
+	image_bitmap_t *visited = &scratch->visited;
+
+	int max_edges = runs->length + 2;
+	if (scratch_reserve((void **)&scratch->edges, &scratch->max_edges, max_edges, sizeof(int), MAX_BARCODE_EDGES)) {
+		runs->edges = scratch->edges;
+	} else {
+		runs->edges = detector->edges;
+		max_edges = MAX_BARCODE_EDGES;
+	}
+
+	int n = 1, dark = 0, pos = 0;
+	runs->edges[0] = 0;
+	while (pos < runs->length) {
+		int x = runs->x + pos * runs->dx, y = runs->y + pos * runs->dy;
+		int v = read_pixel_class_unchecked(img, visited, x, y) == PIXEL_CLASS_DARK;
+		if (v != dark) {
+			if (n + 2 >= max_edges) break; // the rest of the line doesn't fit
+			runs->edges[n++] = pos;
+			dark = v;
+		}
+		pos = runs->dx ? image_bitmap_next_edge(img, visited, x, y) : pos + 1;
+	}
+	runs->edges[n] = pos;
+
+	// ends with a light one
+	if (dark) runs->edges[++n] = pos;
+	runs->num_runs = n;
+	runs->reversed = 0;
+}
+
+// takes the runs from `i` up to `j` as light, once they are read
+static void drop_barcode_runs(barcode_runs_t *runs, int i, int j)
+{
+	if (runs->reversed) {
+		int k = runs->num_runs - j;
+		j = runs->num_runs - i;
+		i = k;
+	}
+	for (int k = i + 1; k <= j; k++) runs->edges[k] = runs->edges[i];
+}
+
+// the quiet zone, `n` runs from `i`, and the next one, to match the start pattern as it's scanned
+static runlength_t barcode_start_runs(barcode_runs_t *runs, int i, int n)
+{
+	runlength_t rl = create_runlength();
+	for (int k = i - 1; k <= i + n; k++) {
+		runlength_next_and_count_add(&rl, k < runs->num_runs ? barcode_run(runs, k) : 0);
 	}
-	if (!runlength_push_value(rl, v)) return 0;
-	if (!v) return 0;
+	return rl;
+}
+
+// a start pattern, and the width of the narrow bars by it
+typedef struct {
+	qrean_code_type_t type; // QREAN_CODE_TYPE_INVALID for EAN or ITF, told apart by the number of the runs
+	float barsize;
+	int quiet_zone; // after the stop pattern, in the narrow bars
+} barcode_start_t;
 
+// the start patterns at the run `i`, a few of them may match
+static int find_barcode_starts(barcode_runs_t *runs, int i, barcode_start_t starts[])
+{
 	int n = 0;
-	float barsize = 0;
+	runlength_t rl;
 
 	// EAN: 101                     1, 1, 1
 	// CODE39: 100010111011101      1, 3, 1, 1, 3, 1, 3, 1, 1
@@ -50,654 +396,2628 @@ static int scan_barcode(runlength_t *rl, image_t *img, image_t *src, int x, int
 	// NW7-C: 1010001000111         1, 1, 1, 3, 1, 3, 3
 	// NW7-D: 1010001110001         1, 1, 1, 3, 3, 3, 1
 
-	if (runlength_match_ratio(rl, 1, 3, 1, 1, 3, 1, 3, 1, 1, 0, -1)) {
+	rl = barcode_start_runs(runs, i, 9);
+	if (runlength_match_ratio(&rl, 1, 3, 1, 1, 3, 1, 3, 1, 1, 0, -1)) {
 		// CODE39
-		n = runlength_sum(rl, 1, 9);
-		barsize = n / (6.0 + 3 * 3);
-		if (runlength_get_count(rl, 10) < 2 * barsize) return 0; // quiet zone required
-	} else if (runlength_match_ratio(rl, 1, 1, 3, 3, 1, 3, 1, 0, -1) || runlength_match_ratio(rl, 1, 3, 1, 3, 1, 1, 3, 0, -1)
-		|| runlength_match_ratio(rl, 1, 1, 1, 3, 1, 3, 3, 0, -1) || runlength_match_ratio(rl, 1, 1, 1, 3, 3, 3, 1, 0, -1)) {
+		float barsize = runlength_sum(&rl, 1, 9) / (6.0 + 3 * 3);
+		if (runlength_get_count(&rl, 10) >= BARCODE_LEAD_IN * barsize) {
+			starts[n++] = (barcode_start_t) { QREAN_CODE_TYPE_CODE39, barsize, BARCODE_QUIET_ZONE };
+		}
+	}
+
+	rl = barcode_start_runs(runs, i, 7);
+	if (runlength_match_ratio(&rl, 1, 1, 3, 3, 1, 3, 1, 0, -1) || runlength_match_ratio(&rl, 1, 3, 1, 3, 1, 1, 3, 0, -1)
+		|| runlength_match_ratio(&rl, 1, 1, 1, 3, 1, 3, 3, 0, -1) || runlength_match_ratio(&rl, 1, 1, 1, 3, 3, 3, 1, 0, -1)) {
 		// NW7
-		n = runlength_sum(rl, 1, 7);
-		barsize = n / (4.0 + 3 * 3);
-		if (runlength_get_count(rl, 8) < 2 * barsize) return 0; // quiet zone required
-	} else if (runlength_match_ratio(rl, 1, 1, 1, 1, 4, 0, -1)) {
+		float barsize = runlength_sum(&rl, 1, 7) / (4.0 + 3 * 3);
+		if (runlength_get_count(&rl, 8) >= BARCODE_LEAD_IN * barsize) {
+			starts[n++] = (barcode_start_t) { QREAN_CODE_TYPE_NW7, barsize, BARCODE_QUIET_ZONE };
+		}
+	}
+
+	rl = barcode_start_runs(runs, i, 5);
+	if (runlength_match_ratio(&rl, 1, 1, 1, 1, 4, 0, -1)) {
 		// CODE93
-		n = runlength_sum(rl, 1, 5);
-		barsize = n / 8.0;
-		if (runlength_get_count(rl, 6) < 2 * barsize) return 0; // quiet zone required
-	} else if (runlength_match_ratio(rl, 1, 1, 1, 0, -1)) {
-		// EAN or ITF
-		n = runlength_sum(rl, 1, 3);
-		barsize = n / 3.0;
-		if (runlength_get_count(rl, 4) < 2 * barsize) return 0; // quiet zone required
-	}
-
-	qrean_code_type_t codes[] = {
-		QREAN_CODE_TYPE_EAN13,
-		QREAN_CODE_TYPE_EAN8,
-		QREAN_CODE_TYPE_UPCA,
-		QREAN_CODE_TYPE_CODE39,
-		QREAN_CODE_TYPE_CODE93,
-		QREAN_CODE_TYPE_ITF,
-		QREAN_CODE_TYPE_NW7,
-	};
+		float barsize = runlength_sum(&rl, 1, 5) / 8.0;
+		if (runlength_get_count(&rl, 6) >= BARCODE_LEAD_IN * barsize) {
+			starts[n++] = (barcode_start_t) { QREAN_CODE_TYPE_CODE93, barsize, BARCODE_QUIET_ZONE };
+		}
+	}
 
-	int sx = x - (n + 1) * dx;
-	int sy = y - (n + 1) * dy;
-	int ex = sx;
-	int ey = sy;
-	int found = 0;
+	rl = barcode_start_runs(runs, i, 3);
+	if (runlength_match_ratio(&rl, 1, 1, 1, 0, -1)) {
+		// EAN or ITF, the pattern is found in the others too, so the end guard is checked later
+		float barsize = runlength_sum(&rl, 1, 3) / 3.0;
+		if (runlength_get_count(&rl, 4) >= BARCODE_LEAD_IN * barsize) {
+			starts[n++] = (barcode_start_t) { QREAN_CODE_TYPE_INVALID, barsize, BARCODE_EAN_QUIET_ZONE };
+		}
+	}
 
-#ifdef BARCODE_DETECTION_METHOD_2
-	char buf[128] = {};
-	bitstream_t bs = create_bitstream(buf, sizeof(buf) * 8, NULL, NULL);
-#endif
-	runlength_t rl2 = create_runlength();
-	int bars = 0;
-	for (int yy = sy, xx = sx; 0 <= xx && xx < (int)img->width && 0 <= yy && yy < (int)img->height; xx += dx, yy += dy) {
-		uint32_t v = image_read_pixel(img, POINT(xx, yy));
-		if (runlength_push_value(&rl2, v)) {
-			runlength_count_t last_count = runlength_get_count(&rl2, 1);
-			int c = round(last_count / barsize);
-			bars += c;
-
-#ifdef BARCODE_DETECTION_METHOD_2
-			if (c <= 32) {
-				bitstream_write_bits(&bs, v ? 0xffffffff : 0, c);
-			}
-#endif
+	return n;
+}
+
+// EAN-13 and UPC-A have 59 runs, EAN-8 has 43, and ITF has 7 + 10n, from the run `i` up to the quiet zone at `j`
+// they end with the guard of 1, 1, 1 or the stop pattern of 3, 1, 1, not to be taken from a 1:1:1 inside the others
+static int ean_like_code_types(barcode_runs_t *runs, int i, int j, qrean_code_type_t codes[])
+{
+	int num_runs = j - i;
+	runlength_t rl = barcode_start_runs(runs, j - 3, 3);
+	int ean_end = runlength_match_ratio(&rl, 1, 1, 1, 0, -1);
+	int itf_end = runlength_match_ratio(&rl, 3, 1, 1, 0, -1);
+
+	if (num_runs == 59 && ean_end) {
+		codes[0] = QREAN_CODE_TYPE_EAN13;
+		codes[1] = QREAN_CODE_TYPE_UPCA;
+		return 2;
+	}
+	if (num_runs == 43 && ean_end) {
+		codes[0] = QREAN_CODE_TYPE_EAN8;
+		return 1;
+	}
+	if (num_runs > 7 && (num_runs - 7) % 10 == 0 && itf_end) {
+		codes[0] = QREAN_CODE_TYPE_ITF;
+		return 1;
+	}
+	return 0;
+}
 
-			continue;
+// sizes `n` elements of a character into `modules` modules, up to `max` each
+// by the distances between the similar edges, which don't change if the bars are printed wider or thinner
+static int size_by_edges(const runlength_count_t *widths, int n, int modules, int max, int *sizes)
+{
+	float total = 0;
+	for (int k = 0; k < n; k++) total += widths[k];
+	if (!total) return 0;
+
+	int t[BARCODE_CHAR_RUNS];
+	for (int k = 0; k + 1 < n; k++) t[k] = roundf((widths[k] + widths[k + 1]) * modules / total);
+
+	// the first element decides the rest, and the nearest one to the widths is taken
+	int best = 0;
+	float best_err = 0;
+	for (int first = 1; first <= max; first++) {
+		int size = first, sum = first;
+		float err = fabsf(widths[0] * modules / total - size);
+		int k;
+		for (k = 0; k + 1 < n; k++) {
+			size = t[k] - size;
+			if (size < 1 || size > max) break;
+			sum += size;
+			err += fabsf(widths[k + 1] * modules / total - size);
+		}
+		if (k + 1 < n || sum != modules) continue;
+		if (!best || err < best_err) {
+			best = first;
+			best_err = err;
 		}
+	}
+	if (!best) return 0;
 
-		if (v && runlength_get_count(&rl2, 0) >= barsize * 10) {
-			// stop
-			ex = xx - (runlength_get_count(&rl2, 0) - 1) * dx;
-			ey = yy - (runlength_get_count(&rl2, 0) - 1) * dy;
-			barsize = sqrt((ex - sx) * (ex - sx) + (ey - sy) * (ey - sy)) / (float)bars;
-			break;
+	sizes[0] = best;
+	for (int k = 0; k + 1 < n; k++) sizes[k + 1] = t[k] - sizes[k];
+	return 1;
+}
+
+// sizes `n` elements as wide or narrow, the widest `num_wide` ones are wide
+// or the ones over the middle of the narrowest and the widest, if `num_wide` is 0
+static int size_by_widths(const runlength_count_t *widths, int n, int num_wide, int *sizes)
+{
+	runlength_count_t min = widths[0], max = widths[0];
+	for (int k = 1; k < n; k++) {
+		if (widths[k] < min) min = widths[k];
+		if (widths[k] > max) max = widths[k];
+	}
+
+	int wide = 0;
+	runlength_count_t narrowest_wide = max, widest_narrow = 0;
+	for (int k = 0; k < n; k++) {
+		int is_wide;
+		if (num_wide) {
+			// by the rank, the former one first on a tie
+			int wider = 0;
+			for (int m = 0; m < n; m++) wider += widths[m] > widths[k] || (widths[m] == widths[k] && m < k);
+			is_wide = wider < num_wide;
+		} else {
+			is_wide = widths[k] * 2 > min + max;
 		}
+
+		sizes[k] = is_wide ? BARCODE_WIDE : 1;
+		wide += is_wide;
+		if (is_wide && widths[k] < narrowest_wide) narrowest_wide = widths[k];
+		if (!is_wide && widths[k] > widest_narrow) widest_narrow = widths[k];
 	}
 
-	if (ex == sx && ey == sy) return 0; // not found
+	// 1.5 times at least
+	return wide && narrowest_wide * 2 >= widest_narrow * 3;
+}
 
-	image_transform_matrix_t mat = {
-		{barsize * dx, 0, sx + dx * barsize / 2.0f, barsize * dy, 0, sy + dy * barsize / 2.0f, 0, 0}
-	};
+// writes the modules of `n` elements from the run `i`
+static int write_barcode_modules(uint8_t *line, int pos, int i, const int *sizes, int n)
+{
+	for (int k = 0; k < n; k++) {
+		for (int m = 0; m < sizes[k]; m++) {
+			if (pos >= BARCODE_LINE_MODULES) return -1;
+			WRITE_BIT(line, pos, (i + k) % 2);
+			pos++;
+		}
+	}
+	return pos;
+}
 
-#ifdef BARCODE_DETECTION_METHOD_2
-	bitstream_rewind(&bs);
-#endif
+static int barcode_char_by_edges(barcode_runs_t *runs, int *i, int n, int modules, int max, uint8_t *line, int pos)
+{
+	runlength_count_t widths[BARCODE_CHAR_RUNS];
+	int sizes[BARCODE_CHAR_RUNS];
+	if (pos < 0) return -1;
+
+	barcode_widths(runs, *i, n, widths);
+	if (!size_by_edges(widths, n, modules, max, sizes)) return -1;
+	pos = write_barcode_modules(line, pos, *i, sizes, n);
+	*i += n;
+	return pos;
+}
 
-	for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
-		qrean_t qrean = create_qrean(codes[i]);
+// and the gap after it if any, as a narrow one
+static int barcode_char_by_widths(barcode_runs_t *runs, int *i, int n, int num_wide, int gap, uint8_t *line, int pos)
+{
+	runlength_count_t widths[BARCODE_CHAR_RUNS];
+	int sizes[BARCODE_CHAR_RUNS + 1];
+	if (pos < 0) return -1;
+
+	barcode_widths(runs, *i, n, widths);
+	if (!size_by_widths(widths, n, num_wide, sizes)) return -1;
+	sizes[n] = 1;
+	pos = write_barcode_modules(line, pos, *i, sizes, n + gap);
+	*i += n + gap;
+	return pos;
+}
 
-		qrean_detector_perspective_t warp = create_qrean_detector_perspective(&qrean, src);
-		warp.h = mat;
+// ITF interleaves the bars of a digit and the spaces of the next one
+static int barcode_itf_pair(barcode_runs_t *runs, int *i, uint8_t *line, int pos)
+{
+	runlength_count_t widths[10], bars[5], spaces[5];
+	int sizes[10], bar_sizes[5], space_sizes[5];
+	if (pos < 0) return -1;
+
+	barcode_widths(runs, *i, 10, widths);
+	for (int k = 0; k < 5; k++) {
+		bars[k] = widths[k * 2];
+		spaces[k] = widths[k * 2 + 1];
+	}
+	if (!size_by_widths(bars, 5, 2, bar_sizes) || !size_by_widths(spaces, 5, 2, space_sizes)) return -1;
+	for (int k = 0; k < 5; k++) {
+		sizes[k * 2] = bar_sizes[k];
+		sizes[k * 2 + 1] = space_sizes[k];
+	}
+	pos = write_barcode_modules(line, pos, *i, sizes, 10);
+	*i += 10;
+	return pos;
+}
 
-#ifndef BARCODE_DETECTION_METHOD_2
-		qrean_on_read_pixel(&qrean, qrean_detector_perspective_read_image_pixel, &warp);
-		qrean_on_write_pixel(&qrean, qrean_detector_perspective_write_image_pixel, &warp);
-#else
-		qrean_write_bitstream(&qrean, bs);
-#endif
+// the wide bars are wider than any of the narrow bars over the whole symbol, not only in each character
+// and so are the spaces, as sized on the line from the run `i`
+static int has_even_widths(barcode_runs_t *runs, int i, int n, const uint8_t *line)
+{
+	runlength_count_t widest_narrow[2] = {}, narrowest_wide[2] = {};
+	int pos = 0;
+	for (int k = 0; k < n; k++) {
+		int dark = (i + k) % 2, size = 0;
+		while (pos < BARCODE_LINE_MODULES && READ_BIT(line, pos) == dark) pos++, size++;
+
+		runlength_count_t width = barcode_run(runs, i + k);
+		if (size > 1 && (!narrowest_wide[dark] || width < narrowest_wide[dark])) narrowest_wide[dark] = width;
+		if (size == 1 && width > widest_narrow[dark]) widest_narrow[dark] = width;
+	}
+	return widest_narrow[0] < narrowest_wide[0] && widest_narrow[1] < narrowest_wide[1];
+}
 
-		char buf[256];
-		if (qrean_read_string(&qrean, buf, sizeof(buf))) {
-			qrean_debug_printf("Detected as %s\n", qrean_get_code_type_string(qrean.code->type));
+// sizes the runs of a symbol into the modules, character by character as the symbology is made
+// returns the number of the modules, or -1 if the runs don't make the symbology
+static int size_barcode_modules(qrean_code_type_t type, barcode_runs_t *runs, int i, int num_runs, uint8_t *line)
+{
+	int end = i + num_runs;
+	int pos = 0;
+	memset(line, 0, BARCODE_LINE_MODULES / 8);
+
+	switch (type) {
+	case QREAN_CODE_TYPE_EAN13:
+	case QREAN_CODE_TYPE_UPCA:
+	case QREAN_CODE_TYPE_EAN8: {
+		int digits = (num_runs - 11) / 8;
+		pos = barcode_char_by_edges(runs, &i, 3, 3, 1, line, pos); // start guard
+		for (int n = 0; n < digits; n++) pos = barcode_char_by_edges(runs, &i, 4, 7, 4, line, pos);
+		pos = barcode_char_by_edges(runs, &i, 5, 5, 1, line, pos); // center guard
+		for (int n = 0; n < digits; n++) pos = barcode_char_by_edges(runs, &i, 4, 7, 4, line, pos);
+		pos = barcode_char_by_edges(runs, &i, 3, 3, 1, line, pos); // end guard
+		break;
+	}
 
-			// TODO: XXX: the warp is not accurate
-			on_found(&warp, opaque);
-			found++;
+	case QREAN_CODE_TYPE_CODE39:
+		if (num_runs % 10 != 9) return -1;
+		while (pos >= 0 && i < end) pos = barcode_char_by_widths(runs, &i, 9, 3, i + 9 < end, line, pos);
+		break;
+
+	case QREAN_CODE_TYPE_NW7:
+		if (num_runs % 8 != 7) return -1;
+		while (pos >= 0 && i < end) pos = barcode_char_by_widths(runs, &i, 7, 0, i + 7 < end, line, pos);
+		break;
+
+	case QREAN_CODE_TYPE_CODE93: {
+		if (num_runs % 6 != 1) return -1;
+		while (pos >= 0 && i + 1 < end) pos = barcode_char_by_edges(runs, &i, 6, 9, 4, line, pos);
+		int termination = 1;
+		if (pos >= 0) pos = write_barcode_modules(line, pos, i, &termination, 1);
+		break;
+	}
 
-			// paint dark bar to prevent the bar to be detected twice
-			for (int yy = sy, xx = sx; xx != ex || yy != ey; xx += dx, yy += dy) {
-				uint32_t v = image_read_pixel(img, POINT(xx, yy));
-				if (!v) image_paint(img, POINT(xx, yy), PIXEL(255, 0, 0));
-			}
-		}
+	case QREAN_CODE_TYPE_ITF:
+		pos = barcode_char_by_edges(runs, &i, 4, 4, 1, line, pos); // start
+		while (pos >= 0 && i + 3 < end) pos = barcode_itf_pair(runs, &i, line, pos);
+		pos = barcode_char_by_widths(runs, &i, 3, 1, 0, line, pos); // stop
+		if (pos >= 0 && !has_even_widths(runs, end - num_runs, num_runs, line)) return -1; // no check character to reject the others
+		break;
 
-		qrean_destroy(&qrean);
+	default:
+		return -1;
 	}
 
-	return found;
+	return pos;
 }
 
-int qrean_detector_scan_barcodes(image_t *src, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+// decodes the symbol from the run `i`, and returns the run after it, or 0 if not found
+static int scan_barcode(qrean_detector_t *detector, image_bitmap_t *img, barcode_runs_t *runs, int i,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
 {
-	int step = 10; // XXX: reduce CPU time...
-	int found = 0;
+	qrean_detector_scratch_t *scratch = &detector->scratch;
+	image_bitmap_t *visited = &scratch->visited;
 
-	CREATE_IMAGE_BY_CLONE(work, src);
+	barcode_start_t starts[4];
+	int num_starts = find_barcode_starts(runs, i, starts);
 
-	runlength_t rl = create_runlength();
-	for (int y = 0; y < (int)work.height; y += step) {
-		runlength_init(&rl);
-		for (int x = 0; x < (int)work.width; x++) {
-			scan_barcode(&rl, &work, src, x, y, 1, 0, on_found, opaque);
-		}
-		runlength_init(&rl);
-		for (int x = 0; x < (int)work.width; x++) {
-			scan_barcode(&rl, &work, src, work.width - 1 - x, y, -1, 0, on_found, opaque);
+	int found = 0;
+	int j = 0;
+	for (int s = 0; s < num_starts && !found; s++) {
+		// the stop pattern is followed by the quiet zone
+		for (j = i + 1; j < runs->num_runs; j += 2) {
+			if (barcode_run(runs, j) >= starts[s].barsize * starts[s].quiet_zone) break;
 		}
-	}
+		if (j >= runs->num_runs || j - i > BARCODE_MAX_RUNS) continue;
+
+		qrean_code_type_t codes[2] = { starts[s].type };
+		int num_codes = starts[s].type == QREAN_CODE_TYPE_INVALID ? ean_like_code_types(runs, i, j, codes) : 1;
+
+		int from = barcode_run_pos(runs, i);
+		int length = barcode_run_pos(runs, j) - from;
+		int dx = runs->reversed ? -runs->dx : runs->dx;
+		int dy = runs->reversed ? -runs->dy : runs->dy;
+		int sx, sy;
+		barcode_run_pixel(runs, from, &sx, &sy);
+
+		for (int n = 0; n < num_codes; n++) {
+			uint8_t line[BARCODE_LINE_MODULES / 8];
+			int modules = size_barcode_modules(codes[n], runs, i, j - i, line);
+			if (modules <= 0) continue;
+
+			float barsize = length / (float)modules;
+			image_transform_matrix_t mat = {
+				{barsize * dx, 0, sx + dx * barsize / 2.0f, barsize * dy, 0, sy + dy * barsize / 2.0f, 0, 0}
+			};
+
+			qrean_t qrean = create_qrean(codes[n]);
+			qrean_detector_perspective_t warp = create_qrean_detector_perspective(detector, &qrean, img);
+			warp.h = mat;
+			qrean_on_read_pixel(&qrean, read_barcode_line_pixel, line);
+
+			char buf[256];
+			if (qrean_read_string(&qrean, buf, sizeof(buf))) {
+				detector_debug_printf(detector, "Detected as %s\n", qrean_get_code_type_string(qrean.code->type));
+
+				// TODO: XXX: the warp is not accurate
+				on_found(&warp, opaque);
+				found++;
+			}
 
-	for (int x = 0; x < (int)work.width; x += step) {
-		runlength_init(&rl);
-		for (int y = 0; y < (int)work.height; y++) {
-			scan_barcode(&rl, &work, src, x, y, 0, 1, on_found, opaque);
+			qrean_destroy(&qrean);
 		}
-
-		runlength_init(&rl);
-		for (int y = 0; y < (int)work.height; y++) {
-			scan_barcode(&rl, &work, src, x, work.height - 1 - y, 0, -1, on_found, opaque);
+	}
+	if (!found) return 0;
+
+	// mark the bars as visited, not to be detected twice by the other lines
+	for (int k = i; k < j; k += 2) {
+		int x, y;
+		barcode_run_pixel(runs, barcode_run_pos(runs, k) + barcode_run(runs, k) / 2, &x, &y);
+		if (read_pixel_class_at(img, visited, x, y) == PIXEL_CLASS_DARK) {
+			image_bitmap_paint_bounded(visited, img, POINT(x, y), 1, scratch_stack(scratch), 0);
 		}
 	}
+	drop_barcode_runs(runs, i, j);
 
-	DESTROY_IMAGE(work);
+	return j;
+}
 
-	return found;
+// the lines to scan for the barcodes, the rows then the columns
+static int barcode_lines(image_bitmap_t *src)
+{
+	return (src->height + BARCODE_LINE_STEP - 1) / BARCODE_LINE_STEP + (src->width + BARCODE_LINE_STEP - 1) / BARCODE_LINE_STEP;
 }
 
-qrean_detector_qr_finder_candidate_t *qrean_detector_scan_qr_finder_pattern(image_t *src, int *found)
+// the row at `y` if `dx`, or the column at `x` if `dy`
+static barcode_runs_t create_barcode_runs(image_bitmap_t *src, int x, int y, int dx, int dy)
 {
-	static qrean_detector_qr_finder_candidate_t candidates[MAX_CANDIDATES];
-	int candidx = 0;
+	barcode_runs_t runs = { .x = x, .y = y, .dx = dx, .dy = dy, .length = dx ? src->width : src->height };
+	return runs;
+}
 
-	CREATE_IMAGE_BY_CLONE(img, src);
+// reads the line once, and finds the symbols on the runs of it both ways
+static int scan_barcode_runs(qrean_detector_t *detector, image_bitmap_t *src, barcode_runs_t *runs,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
 
-	for (int y = 0; y < (int)img.height; y++) {
-		runlength_t rl = create_runlength();
+	collect_barcode_runs(detector, src, runs);
 
-		for (int x = 0; x < (int)img.width; x++) {
-			uint32_t v = image_read_pixel(&img, POINT(x, y));
-			if (v != 0 && v != PIXEL(255, 255, 255)) {
-				runlength_init(&rl);
-				continue;
+	for (runs->reversed = 0; runs->reversed <= 1; runs->reversed++) {
+		for (int i = 1; i < runs->num_runs; i += 2) {
+			int next = scan_barcode(detector, src, runs, i, on_found, opaque);
+			if (next) {
+				found++;
+				i = next;
 			}
-			if (!runlength_push_value(&rl, v)) continue;
-
-			if (!v || !runlength_match_ratio(&rl, 1, 1, 3, 1, 1, 0, -1)) continue;
-
-			// assert almost [n, n, 3n, n, n, 1]
-
-			int cx = x - runlength_sum(&rl, 1, 3) + runlength_get_count(&rl, 3) / 2; // dark module on the center
-			int lx = x - runlength_sum(&rl, 1, 5) + runlength_get_count(&rl, 5) / 2; // dark module on the left ring
-			int rx = x - runlength_sum(&rl, 1, 1) + runlength_get_count(&rl, 1) / 2; // dark module on the right ring
+		}
+	}
 
-			int len = runlength_sum(&rl, 1, 5);
-			int cy = y;
+	return found;
+}
 
-			// not a dark module
-			if (image_read_pixel(&img, POINT(cx, cy)) != 0) continue;
-			if (image_read_pixel(&img, POINT(lx, cy)) != 0) continue;
-			if (image_read_pixel(&img, POINT(rx, cy)) != 0) continue;
+static int scan_barcode_line(qrean_detector_t *detector, image_bitmap_t *src, int line,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int rows = (src->height + BARCODE_LINE_STEP - 1) / BARCODE_LINE_STEP;
+	barcode_runs_t runs;
+	if (line < rows) {
+		runs = create_barcode_runs(src, 0, line * BARCODE_LINE_STEP, 1, 0);
+	} else {
+		runs = create_barcode_runs(src, (line - rows) * BARCODE_LINE_STEP, 0, 0, 1);
+	}
+	return scan_barcode_runs(detector, src, &runs, on_found, opaque);
+}
 
-			// check vertical runlength
-			runlength_t rlvu = create_runlength();
-			runlength_t rlvd = create_runlength();
-			int found_u = 0, found_d = 0;
-			for (int yy = 0; yy < len; yy++) {
-				if (!found_u && runlength_push_value(&rlvu, image_read_pixel(&img, POINT(cx, cy - yy)))) {
-					if (runlength_match_ratio(&rlvu, 3, 2, 2, 0, -1)) {
-						found_u = runlength_sum(&rlvu, 1, 3);
-					}
-				}
-				if (!found_d && runlength_push_value(&rlvd, image_read_pixel(&img, POINT(cx, cy + yy)))) {
-					if (runlength_match_ratio(&rlvd, 3, 2, 2, 0, -1)) {
-						found_d = runlength_sum(&rlvd, 1, 3);
-					}
-				}
-			}
-			if (!found_u && runlength_match_ratio(&rlvu, 3, 2, 2, 0, -1)) {
-				found_u = runlength_sum(&rlvu, 1, 3);
-			}
-			if (!found_d && runlength_match_ratio(&rlvd, 3, 2, 2, 0, -1)) {
-				found_d = runlength_sum(&rlvd, 1, 3);
-			}
+int qrean_detector_scan_barcodes_bitmap(
+	qrean_detector_t *detector, image_bitmap_t *src, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
 
-			if (candidx < MAX_CANDIDATES && found_u && found_d) {
-				image_pixel_t inner_block_color = PIXEL(0, 255, 0);
-				image_pixel_t ring_color = PIXEL(255, 0, 0);
+	if (!scratch_fits(detector, src)) return 0;
+	image_bitmap_clear(&detector->scratch.visited);
 
-				// mark visit flag by painting inner most block
-				image_paint_result_t inner_block = image_paint(&img, POINT(cx, cy), inner_block_color);
+	for (int line = 0; line < barcode_lines(src); line++) {
+		found += scan_barcode_line(detector, src, line, on_found, opaque);
+	}
 
-				// let's make sure they are disconnected from the inner most block
-				if (image_read_pixel(&img, POINT(lx, cy)) != PIXEL(0, 0, 0)) {
-					continue;
-				}
-				if (image_read_pixel(&img, POINT(rx, cy)) != PIXEL(0, 0, 0)) {
-					continue;
-				}
+	return found;
+}
 
-				// let's make sure they are connected
-				image_paint_result_t ring = image_paint(&img, POINT(lx, cy), ring_color);
-				if (image_read_pixel(&img, POINT(lx, cy)) != image_read_pixel(&img, POINT(rx, cy))) {
-					// paint it back ;)
-					image_paint(&img, POINT(lx, cy), PIXEL(0, 0, 0));
-					continue;
-				}
+// finds the corners of a blob, as the farthest points from the center in each quadrant
+// the first corner is the farthest one, or the one in the given direction within the spread, then clockwise from it
+// the points are fed on each pass, until corner_finder_next_pass() returns 0
+typedef struct {
+	image_point_t center;
+	float ux, uy; // the direction of the first corner
+	float cone; // the first quadrant is narrowed to this, as p >= |q| * cone
+	float tolerance; // the points within this from the farthest are averaged, for the subpixel corner
+	float outset; // moves the corners outward, in pixels
+	int pass;
+	float dists[4];
+	float near[4];
+	float sx[4], sy[4];
+	int n[4];
+} corner_finder_t;
+
+static corner_finder_t create_corner_finder(image_point_t center, image_point_t direction, float spread)
+{
+	corner_finder_t cf = { center, 0, 0, 1 / tanf(spread), 0.5, 0, POINT_IS_INVALID(direction) ? 0 : 1 };
+	for (int i = 0; i < 4; i++) {
+		cf.dists[i] = -1;
+		cf.near[i] = 0;
+		cf.sx[i] = cf.sy[i] = 0;
+		cf.n[i] = 0;
+	}
 
-				float real_cx = (ring.extent.left + ring.extent.right) / 2.0f;
-				float real_cy = (ring.extent.top + ring.extent.bottom) / 2.0f;
-				if (image_read_pixel(&img, POINT(real_cx, real_cy)) != inner_block_color) continue;
-
-				// find ring corners
-				int w = ring.extent.right - ring.extent.left;
-				int h = ring.extent.bottom - ring.extent.top;
-				int cidx = 0;
-				float corners[4] = { NAN, NAN, NAN, NAN };
-
-				for (float r = sqrt(w * w + h * h) * 1.1; r > 0 && cidx < 4; r -= 0.2) {
-					for (float theta = 0; theta < 2 * M_PI && cidx < 4; theta += 1.0 / r) {
-						float x = floor(cx + r * sin(theta));
-						float y = floor(cy - r * cos(theta));
-
-						if (image_read_pixel(&img, POINT(x, y)) == ring_color) {
-							int slot = !cidx ? 0 : floor(fmod(theta + 2 * M_PI + M_PI_4 - corners[0], 2 * M_PI) / M_PI_2);
-							assert(0 <= slot && slot < 4);
-
-							if (isnan(corners[slot])) {
-								candidates[candidx].corners[slot] = POINT(x, y);
-								corners[slot] = theta;
-								cidx++;
-							}
-						}
-					}
-				}
+	if (cf.pass) {
+		float norm = image_point_norm(direction);
+		cf.ux = norm > 0 ? POINT_X(direction) / norm : 1;
+		cf.uy = norm > 0 ? POINT_Y(direction) / norm : 0;
+	}
+	return cf;
+}
 
-				if (cidx < 4) {
-					// No corners... paint it back
-					image_paint(&img, POINT(lx, cy), PIXEL(0, 0, 0));
-					continue;
-				}
+static void corner_finder_add(void *opaque, int x, int y)
+{
+	corner_finder_t *cf = (corner_finder_t *)opaque;
+	float dx = x - POINT_X(cf->center);
+	float dy = y - POINT_Y(cf->center);
+	float d = dx * dx + dy * dy;
+	int slot = 0;
+
+	if (cf->pass > 0) {
+		// along the first corner, and 90 degrees clockwise from it
+		float p = dx * cf->ux + dy * cf->uy;
+		float q = dy * cf->ux - dx * cf->uy;
+		slot = p >= fabsf(q) * cf->cone ? 0 : q >= fabsf(p) ? 1 : -p >= fabsf(q) ? 2 : 3;
+	}
 
-				candidates[candidx].center = POINT(real_cx, real_cy);
-				candidates[candidx].extent = ring.extent;
-				candidates[candidx].area = inner_block.area;
-				candidx++;
+	if (cf->pass < 2) {
+		if (d > cf->dists[slot]) {
+			cf->dists[slot] = d;
+			if (cf->pass == 0) {
+				cf->ux = dx;
+				cf->uy = dy;
 			}
 		}
+	} else if (d >= cf->near[slot]) {
+		cf->sx[slot] += x;
+		cf->sy[slot] += y;
+		cf->n[slot]++;
+	}
+}
+
+static int corner_finder_next_pass(corner_finder_t *cf)
+{
+	if (cf->pass == 0) {
+		if (cf->dists[0] <= 0) return 0;
+		float norm = sqrtf(cf->dists[0]);
+		cf->ux /= norm;
+		cf->uy /= norm;
+		cf->dists[0] = -1;
+	} else if (cf->pass == 1) {
+		for (int i = 0; i < 4; i++) {
+			float r = sqrtf(cf->dists[i]) - cf->tolerance;
+			cf->near[i] = cf->tolerance <= 0 ? cf->dists[i] : r > 0 ? r * r : 0;
+		}
+	} else {
+		return 0;
 	}
 
-	DESTROY_IMAGE(img);
+	cf->pass++;
+	return 1;
+}
+
+static image_point_t corner_finder_get(corner_finder_t *cf, int slot)
+{
+	if (cf->pass < 2 || !cf->n[slot]) return POINT_INVALID;
+	image_point_t p = POINT(cf->sx[slot] / cf->n[slot], cf->sy[slot] / cf->n[slot]);
+
+	image_point_t v = image_point_sub(p, cf->center);
+	float norm = image_point_norm(v);
+	if (cf->outset && norm > 0) p = POINT(POINT_X(p) + POINT_X(v) / norm * cf->outset, POINT_Y(p) + POINT_Y(v) / norm * cf->outset);
+	return p;
+}
+
+// traces the outer boundary of the blob in `mask` within the extent, to find its corners
+static void trace_blob_corners(corner_finder_t *cf, image_bitmap_t *mask, image_extent_t extent)
+{
+	// the top-left most pixel of the blob
+	int y = extent.top;
+	int x;
+	for (x = extent.left; x <= extent.right; x++) {
+		if (IMAGE_BITMAP_READ_PIXEL(mask, x, y)) break;
+	}
+	if (x > extent.right) return;
+
+	do {
+		image_bitmap_trace_boundary(mask, x, y, corner_finder_add, cf);
+	} while (corner_finder_next_pass(cf));
+}
+
+// returns 1 if the finder pattern candidate is added
+static int check_qr_finder_pattern(
+	qrean_detector_scratch_t *scratch, image_bitmap_t *img, runlength_t *rl, int x, int y, qrean_detector_qr_finder_candidate_t *candidate)
+{
+	image_bitmap_t *visited = &scratch->visited;
+	image_paint_stack_t *stack = scratch_stack(scratch);
+
+	// assert almost [n, n, 3n, n, n, 1]
+
+	int cx = x - runlength_sum(rl, 1, 3) + runlength_get_count(rl, 3) / 2; // dark module on the center
+	int lx = x - runlength_sum(rl, 1, 5) + runlength_get_count(rl, 5) / 2; // dark module on the left ring
+	int rx = x - runlength_sum(rl, 1, 1) + runlength_get_count(rl, 1) / 2; // dark module on the right ring
+
+	int len = runlength_sum(rl, 1, 5);
+	int cy = y;
+
+	// not a dark module
+	if (read_pixel_class_at(img, visited, cx, cy) != PIXEL_CLASS_DARK) return 0;
+	if (read_pixel_class_at(img, visited, lx, cy) != PIXEL_CLASS_DARK) return 0;
+	if (read_pixel_class_at(img, visited, rx, cy) != PIXEL_CLASS_DARK) return 0;
+
+	// check vertical runlength
+	runlength_t rlvu = create_runlength();
+	runlength_t rlvd = create_runlength();
+	int found_u = 0, found_d = 0;
+	for (int yy = 0; yy < len; yy++) {
+		if (!found_u && runlength_push_value(&rlvu, read_pixel_class_at(img, visited, cx, cy - yy))) {
+			if (runlength_match_ratio(&rlvu, 3, 2, 2, 0, -1)) {
+				found_u = runlength_sum(&rlvu, 1, 3);
+			}
+		}
+		if (!found_d && runlength_push_value(&rlvd, read_pixel_class_at(img, visited, cx, cy + yy))) {
+			if (runlength_match_ratio(&rlvd, 3, 2, 2, 0, -1)) {
+				found_d = runlength_sum(&rlvd, 1, 3);
+			}
+		}
+	}
+	if (!found_u && runlength_match_ratio(&rlvu, 3, 2, 2, 0, -1)) {
+		found_u = runlength_sum(&rlvu, 1, 3);
+	}
+	if (!found_d && runlength_match_ratio(&rlvd, 3, 2, 2, 0, -1)) {
+		found_d = runlength_sum(&rlvd, 1, 3);
+	}
+
+	if (!found_u || !found_d) return 0;
+
+	// blobs larger than this are clearly not the parts of a finder pattern
+	int max_area = len * len * FINDER_PATTERN_MAX_AREA_RATIO;
+
+	// mark visit flag by painting inner most block
+	image_paint_result_t inner_block = image_bitmap_paint_bounded(visited, img, POINT(cx, cy), 1, stack, max_area);
+	if (inner_block.truncated) return 0;
+
+	// let's make sure they are disconnected from the inner most block
+	if (read_pixel_class_at(img, visited, lx, cy) != PIXEL_CLASS_DARK) return 0;
+	if (read_pixel_class_at(img, visited, rx, cy) != PIXEL_CLASS_DARK) return 0;
+
+	// let's make sure they are connected
+	image_paint_result_t ring = image_bitmap_paint_bounded(visited, img, POINT(lx, cy), 1, stack, max_area);
+	if (ring.truncated) return 0; // leave it visited, not to paint it again
+	if (read_pixel_class_at(img, visited, rx, cy) != PIXEL_CLASS_VISITED) {
+		// paint it back ;)
+		image_bitmap_paint_bounded(visited, img, POINT(lx, cy), 0, stack, 0);
+		return 0;
+	}
+
+	// the center must be on the inner most block
+	float real_cx = (ring.extent.left + ring.extent.right) / 2.0f;
+	float real_cy = (ring.extent.top + ring.extent.bottom) / 2.0f;
+	if (read_pixel_class(img, visited, POINT(real_cx, real_cy)) != PIXEL_CLASS_VISITED) return 0;
+	if (real_cx < inner_block.extent.left || inner_block.extent.right < real_cx) return 0;
+	if (real_cy < inner_block.extent.top || inner_block.extent.bottom < real_cy) return 0;
+
+	// find ring corners, on its outer boundary
+	corner_finder_t cf = create_corner_finder(POINT(real_cx, real_cy), POINT_INVALID, M_PI_4);
+	trace_blob_corners(&cf, visited, ring.extent);
+	for (int i = 0; i < 4; i++) {
+		candidate->corners[i] = corner_finder_get(&cf, i);
+		if (POINT_IS_INVALID(candidate->corners[i])) {
+			// No corners... paint it back
+			image_bitmap_paint_bounded(visited, img, POINT(lx, cy), 0, stack, 0);
+			return 0;
+		}
+	}
+
+	candidate->center = POINT(real_cx, real_cy);
+	candidate->extent = ring.extent;
+	candidate->area = inner_block.area;
+	candidate->kind = 0;
+	candidate->num_neighbors = -1;
+
+	return 1;
+}
+
+// scans the rows in the rectangle, and returns the number of the candidates so far
+static int scan_qr_finder_rows(qrean_detector_t *detector, image_bitmap_t *src, int candidx, int left, int top, int right, int bottom)
+{
+	qrean_detector_scratch_t *scratch = &detector->scratch;
+	image_bitmap_t *visited = &scratch->visited;
+
+	for (int y = top; y < bottom; y++) {
+		runlength_t rl = create_runlength();
+
+		// walk through the runs of the same class, rather than pixel by pixel
+		for (int x = left; x < right;) {
+			int v = read_pixel_class_unchecked(src, visited, x, y);
+			if (v == PIXEL_CLASS_VISITED) {
+				int nx = image_bitmap_next_edge(src, visited, x, y);
+				skip_visited_pixels(&rl, nx - x);
+				x = nx;
+				continue;
+			}
+
+			if (runlength_push_value(&rl, v) && v == PIXEL_CLASS_LIGHT && runlength_match_ratio(&rl, 1, 1, 3, 1, 1, 0, -1)) {
+				qrean_detector_qr_finder_candidate_t *candidate = candidate_slot(detector, candidx);
+				if (candidate && check_qr_finder_pattern(scratch, src, &rl, x, y, candidate)) {
+					candidx++;
+				}
+			}
+
+			// the rest of the run
+			int nx = image_bitmap_next_edge(src, visited, x, y);
+			runlength_count_add(&rl, nx - x - 1);
+			x = nx;
+		}
+	}
+
+	return candidx;
+}
+
+// the finder patterns should be this wide or more at the level, 6 pixels per module, or the rotated ones are lost
+#define PYRAMID_MIN_FINDER_SIZE (42)
+// every this rows are sampled at the full resolution, to see the size of the finder patterns
+#define PYRAMID_SAMPLE_ROWS (8)
+
+// checks the run of the core along the column, from the center to the both ends, as check_qr_finder_pattern() does
+static int is_finder_column(image_bitmap_t *src, int cx, int cy, int len)
+{
+	for (int dir = -1; dir <= 1; dir += 2) {
+		runlength_t rl = create_runlength();
+		int found = 0;
+		for (int yy = 0; yy < len && !found; yy++) {
+			if (runlength_push_value(&rl, read_pixel_class_at(src, NULL, cx, cy + yy * dir))) {
+				found = runlength_match_ratio(&rl, 3, 2, 2, 0, -1);
+			}
+		}
+		if (!found) return 0;
+	}
+	return 1;
+}
+
+// the width of the narrowest finder pattern on the sampled rows, or 0 if none
+static int estimate_finder_size(image_bitmap_t *src)
+{
+	int size = 0;
+	for (int y = PYRAMID_SAMPLE_ROWS / 2; y < (int)src->height; y += PYRAMID_SAMPLE_ROWS) {
+		runlength_t rl = create_runlength();
+		for (int x = 0; x < (int)src->width;) {
+			int v = read_pixel_class_unchecked(src, NULL, x, y);
+			if (runlength_push_value(&rl, v) && v == PIXEL_CLASS_LIGHT && runlength_match_ratio(&rl, 1, 1, 3, 1, 1, 0, -1)) {
+				int len = runlength_sum(&rl, 1, 5);
+				int cx = x - runlength_sum(&rl, 1, 3) + runlength_get_count(&rl, 3) / 2;
+				if ((!size || len < size) && is_finder_column(src, cx, y, len)) size = len;
+			}
+
+			int nx = image_bitmap_next_edge(src, NULL, x, y);
+			runlength_count_add(&rl, nx - x - 1);
+			x = nx;
+		}
+	}
+	return size;
+}
+
+// the level as configured at most, where the narrowest finder pattern is still wide enough
+static int pyramid_level(qrean_detector_t *detector, image_bitmap_t *src)
+{
+	int max_level = detector->pyramid_level == QREAN_DETECTOR_PYRAMID_AUTO ? QREAN_DETECTOR_PYRAMID_MAX_LEVEL : detector->pyramid_level;
+	if (max_level <= 0) return 0;
+
+	int size = estimate_finder_size(src);
+	int level = 0;
+	while (level < max_level && (size >> (level + 1)) >= PYRAMID_MIN_FINDER_SIZE) level++;
+	detector_debug_printf(detector, "Pyramid level %d, for the finder patterns of %d pixels\n", level, size);
+	return level;
+}
+
+// finds the finder patterns on the downscaled image, then again at the full resolution around each of them
+// returns -1 if the downscaled image can't be made
+static int scan_qr_finder_pyramid(qrean_detector_t *detector, image_bitmap_t *src, int level)
+{
+	qrean_detector_scratch_t *scratch = &detector->scratch;
+	int factor = 1 << level;
+	size_t width = src->width / factor, height = src->height / factor;
+	size_t words = IMAGE_BITMAP_STRIDE(width) * height;
+	if (!width || !height) return -1;
+	if (!scratch_reserve((void **)&scratch->pyramid, &scratch->max_pyramid, words, sizeof(image_bitmap_word_t), words + 1)) return -1;
+
+	image_bitmap_t coarse = create_image_bitmap(width, height, scratch->pyramid);
+	image_bitmap_downscale(&coarse, src, factor);
+
+	// the work buffers are large enough for the smaller image
+	image_bitmap_t visited = scratch->visited, painted = scratch->painted;
+	scratch->width = width;
+	scratch->height = height;
+	scratch->visited = create_image_bitmap(width, height, visited.buffer);
+	scratch->painted = create_image_bitmap(width, height, painted.buffer);
+	image_bitmap_clear(&scratch->visited);
+
+	int num_coarse = scan_qr_finder_rows(detector, &coarse, 0, 0, 0, width, height);
+
+	scratch->width = src->width;
+	scratch->height = src->height;
+	scratch->visited = visited;
+	scratch->painted = painted;
+	image_bitmap_clear(&scratch->visited);
+
+	// the refined ones are appended, and moved to the front at last
+	int candidx = num_coarse;
+	for (int i = 0; i < num_coarse; i++) {
+		image_extent_t extent = candidate_list(detector)[i].extent;
+		float margin = (extent.right - extent.left + 1) / 4 + 2; // a module or more around the ring
+		int left = fmaxf(0, (extent.left - margin) * factor);
+		int top = fmaxf(0, (extent.top - margin) * factor);
+		int right = fminf(src->width, (extent.right + 1 + margin) * factor);
+		int bottom = fminf(src->height, (extent.bottom + 1 + margin) * factor);
+		candidx = scan_qr_finder_rows(detector, src, candidx, left, top, right, bottom);
+	}
+
+	qrean_detector_qr_finder_candidate_t *candidates = candidate_list(detector);
+	memmove(candidates, candidates + num_coarse, sizeof(qrean_detector_qr_finder_candidate_t) * (candidx - num_coarse));
+	detector_debug_printf(detector, "Pyramid level %d: %d candidates, %d refined\n", level, num_coarse, candidx - num_coarse);
+
+	return candidx - num_coarse;
+}
+
+qrean_detector_qr_finder_candidate_t *qrean_detector_scan_qr_finder_pattern_bitmap(
+	qrean_detector_t *detector, image_bitmap_t *src, int *found)
+{
+	int candidx = -1;
+
+	if (!scratch_fits(detector, src)) src = NULL;
+
+	if (src) {
+		int level = pyramid_level(detector, src);
+		if (level > 0) candidx = scan_qr_finder_pyramid(detector, src, level);
+	}
+	// at the full resolution, also if nothing is found on the downscaled image
+	if (src && candidx <= 0) {
+		image_bitmap_clear(&detector->scratch.visited);
+		candidx = scan_qr_finder_rows(detector, src, 0, 0, 0, src->width, src->height);
+	}
+	if (candidx < 0) candidx = 0;
+
+	// guardian
+	qrean_detector_qr_finder_candidate_t *candidates = candidate_list(detector);
+	candidates[candidx].center = POINT(NAN, NAN);
+
+	if (found) *found = candidx;
+
+	return candidates;
+}
+
+// connected component labeling on the runs, with union-find
+// dark pixels are 4-connected, and light pixels are 8-connected, so that they never cross each other
+typedef struct {
+	qrean_detector_labeling_run_t *runs;
+	size_t num_runs;
+	size_t max_runs;
+
+	qrean_detector_labeling_component_t *components;
+	size_t num_components;
+	size_t max_components;
+
+	size_t *rows; // the first run of each row
+} labeling_t;
+
+static int labeling_find(labeling_t *lb, int label)
+{
+	qrean_detector_labeling_component_t *c = lb->components;
+	while (c[label].parent != label) {
+		c[label].parent = c[c[label].parent].parent;
+		label = c[label].parent;
+	}
+	return label;
+}
+
+// the smaller label becomes the root, as it is the first one in the raster order
+static int labeling_union(labeling_t *lb, int a, int b)
+{
+	a = labeling_find(lb, a);
+	b = labeling_find(lb, b);
+	if (a < b) {
+		lb->components[b].parent = a;
+		return a;
+	}
+	lb->components[a].parent = b;
+	return b;
+}
+
+static void labeling_add_run(labeling_t *lb, int label, int x1, int x2, int y)
+{
+	qrean_detector_labeling_component_t *c = &lb->components[label];
+	int len = x2 - x1 + 1;
+
+	c->area += len;
+	c->sum_x += (int64_t)(x1 + x2) * len / 2;
+	c->sum_y += (int64_t)y * len;
+	if (x1 < c->left) c->left = x1;
+	if (x2 > c->right) c->right = x2;
+	if (y < c->top) c->top = y;
+	if (y > c->bottom) c->bottom = y;
+}
+
+static void labeling_merge(qrean_detector_labeling_component_t *dst, qrean_detector_labeling_component_t *src)
+{
+	dst->area += src->area;
+	dst->sum_x += src->sum_x;
+	dst->sum_y += src->sum_y;
+	if (src->left < dst->left) dst->left = src->left;
+	if (src->right > dst->right) dst->right = src->right;
+	if (src->top < dst->top) dst->top = src->top;
+	if (src->bottom > dst->bottom) dst->bottom = src->bottom;
+}
+
+static int labeling_scan(labeling_t *lb, image_bitmap_t *src)
+{
+	for (int y = 0; y < (int)src->height; y++) {
+		size_t prev = y > 0 ? lb->rows[y - 1] : 0;
+		size_t prev_end = lb->num_runs;
+		lb->rows[y] = lb->num_runs;
+
+		for (int x = 0; x < (int)src->width;) {
+			int nx = image_bitmap_next_edge(src, NULL, x, y);
+			bit_t dark = IMAGE_BITMAP_READ_PIXEL(src, x, y);
+			int x1 = x, x2 = nx - 1;
+			int reach = dark ? 0 : 1;
+			int label = -1;
+
+			while (prev < prev_end && lb->runs[prev].x2 < x1 - reach) prev++;
+			for (size_t i = prev; i < prev_end && lb->runs[i].x1 <= x2 + reach; i++) {
+				if (lb->components[lb->runs[i].label].dark != dark) continue;
+				label = label < 0 ? labeling_find(lb, lb->runs[i].label) : labeling_union(lb, label, lb->runs[i].label);
+			}
+
+			if (label < 0) {
+				size_t size = sizeof(qrean_detector_labeling_component_t);
+				if (!scratch_reserve((void **)&lb->components, &lb->max_components, lb->num_components, size, 1024)) return 0;
+				label = lb->num_components++;
+
+				qrean_detector_labeling_component_t c = {
+					.parent = label,
+					.enclosing = x1 > 0 ? lb->runs[lb->num_runs - 1].label : -1, // the left one encloses the new one
+					.dark = dark,
+					.left = x1,
+					.top = y,
+					.right = x2,
+					.bottom = y,
+				};
+				lb->components[label] = c;
+			}
+			labeling_add_run(lb, label, x1, x2, y);
+
+			if (!scratch_reserve((void **)&lb->runs, &lb->max_runs, lb->num_runs, sizeof(qrean_detector_labeling_run_t), 1024)) return 0;
+			qrean_detector_labeling_run_t run = { x1, x2, label };
+			lb->runs[lb->num_runs++] = run;
+
+			x = nx;
+		}
+	}
+	lb->rows[src->height] = lb->num_runs;
+
+	// gather the stats into the roots
+	for (size_t i = 0; i < lb->num_components; i++) {
+		int root = labeling_find(lb, i);
+		if (root != (int)i) labeling_merge(&lb->components[root], &lb->components[i]);
+	}
+
+	return 1;
+}
+
+static int labeling_find_ring_corners(labeling_t *lb, int ring, image_point_t center, image_point_t corners[4])
+{
+	qrean_detector_labeling_component_t *c = &lb->components[ring];
+	corner_finder_t cf = create_corner_finder(center, POINT_INVALID, M_PI_4);
+
+	// the farthest pixels are always on the ends of the runs
+	do {
+		for (int y = c->top; y <= c->bottom; y++) {
+			for (size_t i = lb->rows[y]; i < lb->rows[y + 1]; i++) {
+				if (labeling_find(lb, lb->runs[i].label) != ring) continue;
+
+				corner_finder_add(&cf, lb->runs[i].x1, y);
+				if (lb->runs[i].x2 != lb->runs[i].x1) corner_finder_add(&cf, lb->runs[i].x2, y);
+			}
+		}
+	} while (corner_finder_next_pass(&cf));
+
+	for (int i = 0; i < 4; i++) {
+		corners[i] = corner_finder_get(&cf, i);
+		if (POINT_IS_INVALID(corners[i])) return 0;
+	}
+	return 1;
+}
+
+// checks if the core, the gap around it, and the ring around them look like a finder pattern
+static int labeling_is_finder_pattern(
+	qrean_detector_labeling_component_t *core, qrean_detector_labeling_component_t *gap, qrean_detector_labeling_component_t *ring)
+{
+	// 3x3 modules, 5x5 - 3x3 modules, 7x7 - 5x5 modules
+	if (gap->area < core->area * 0.4 || core->area * 5 < gap->area) return 0;
+	if (ring->area < core->area * 0.8 || core->area * 8 < ring->area) return 0;
+
+	float core_w = core->right - core->left + 1;
+	float core_h = core->bottom - core->top + 1;
+	float ring_w = ring->right - ring->left + 1;
+	float ring_h = ring->bottom - ring->top + 1;
+	if (ring_w < core_w * 1.6 || core_w * 3.5 < ring_w) return 0;
+	if (ring_h < core_h * 1.6 || core_h * 3.5 < ring_h) return 0;
+
+	// the core must be on the center of the ring, within a module
+	float cx = (float)core->sum_x / core->area;
+	float cy = (float)core->sum_y / core->area;
+	if (fabs(cx - (ring->left + ring->right) / 2.0f) > ring_w / 7) return 0;
+	if (fabs(cy - (ring->top + ring->bottom) / 2.0f) > ring_h / 7) return 0;
+
+	return 1;
+}
+
+qrean_detector_qr_finder_candidate_t *qrean_detector_scan_qr_finder_pattern_by_labeling(
+	qrean_detector_t *detector, image_bitmap_t *src, int *found)
+{
+	int candidx = 0;
+
+	// the buffers grown are kept in the scratch, or the ones given are used as is without malloc
+	labeling_t lb = {};
+	lb.rows = detector->scratch.rows;
+	lb.runs = detector->scratch.runs;
+	lb.max_runs = detector->scratch.max_runs;
+	lb.components = detector->scratch.components;
+	lb.max_components = detector->scratch.max_components;
+
+	int labeled = scratch_fits(detector, src) && lb.rows && labeling_scan(&lb, src);
+	if (labeled) {
+		detector_debug_printf(detector, "components: %zu, runs: %zu\n", lb.num_components, lb.num_runs);
+
+		for (size_t i = 0; i < lb.num_components; i++) {
+			qrean_detector_labeling_component_t *core = &lb.components[i];
+			if (core->parent != (int)i || !core->dark || core->enclosing < 0) continue;
+
+			int gap = labeling_find(&lb, core->enclosing);
+			if (lb.components[gap].enclosing < 0) continue;
+			int ring = labeling_find(&lb, lb.components[gap].enclosing);
+
+			if (!labeling_is_finder_pattern(core, &lb.components[gap], &lb.components[ring])) continue;
+
+			qrean_detector_qr_finder_candidate_t *candidate = candidate_slot(detector, candidx);
+			if (!candidate) break;
+
+			image_point_t center = POINT((float)core->sum_x / core->area, (float)core->sum_y / core->area);
+			if (!labeling_find_ring_corners(&lb, ring, center, candidate->corners)) continue;
+
+			candidate->center = center;
+			candidate->extent.left = lb.components[ring].left;
+			candidate->extent.top = lb.components[ring].top;
+			candidate->extent.right = lb.components[ring].right;
+			candidate->extent.bottom = lb.components[ring].bottom;
+			candidate->area = core->area;
+			candidate->kind = 0;
+			candidate->num_neighbors = -1;
+			candidx++;
+		}
+	}
+
+	detector->scratch.runs = lb.runs;
+	detector->scratch.max_runs = lb.max_runs;
+	detector->scratch.components = lb.components;
+	detector->scratch.max_components = lb.max_components;
+
+	if (!labeled) {
+		detector_debug_printf(detector, "labeling failed, falling back to the run-length scan\n");
+		return qrean_detector_scan_qr_finder_pattern_bitmap(detector, src, found);
+	}
+
+	// guardian
+	qrean_detector_qr_finder_candidate_t *candidates = candidate_list(detector);
+	candidates[candidx].center = POINT(NAN, NAN);
+
+	if (found) *found = candidx;
+
+	return candidates;
+}
+
+qrean_detector_perspective_t create_qrean_detector_perspective(qrean_detector_t *detector, qrean_t *qrean, image_bitmap_t *img)
+{
+	qrean_detector_perspective_t warp = {
+		.detector = detector,
+		.qrean = qrean,
+		.img = img,
+	};
+	return warp;
+}
+
+void qrean_detector_perspective_setup_by_qr_finder_pattern_centers(
+	qrean_detector_perspective_t *warp, image_point_t src[3], int border_offset)
+{
+	warp->src[0] = POINT(3 + border_offset, 3 + border_offset); // center of the 1st keystone
+	warp->src[1] = POINT(warp->qrean->canvas.symbol_width - 4 - border_offset, 3 + border_offset); // center of the 2nd keystone
+	warp->src[2] = POINT(warp->qrean->canvas.symbol_width - 4 - border_offset,
+		warp->qrean->canvas.symbol_height - 4 - border_offset); // center of the 4th estimated pseudo keystone
+	warp->src[3] = POINT(3 + border_offset, warp->qrean->canvas.symbol_height - 4 - border_offset); // center of the 3rd keystone
+
+	warp->dst[0] = src[0];
+	warp->dst[1] = src[1];
+	warp->dst[2] = POINT(POINT_X(src[0]) + (POINT_X(src[1]) - POINT_X(src[0])) + (POINT_X(src[2]) - POINT_X(src[0])),
+		POINT_Y(src[0]) + (POINT_Y(src[1]) - POINT_Y(src[0])) + (POINT_Y(src[2]) - POINT_Y(src[0])));
+	warp->dst[3] = src[2];
+
+	warp->h = create_image_transform_matrix(warp->src, warp->dst);
+
+	qrean_on_read_pixel(warp->qrean, qrean_detector_perspective_read_image_pixel, warp);
+	qrean_on_write_pixel(warp->qrean, qrean_detector_perspective_write_image_pixel, warp);
+}
+
+// the ring corners are on the center of the corner pixels
+static void ring_corners_correspondence(image_point_t ring[4], int offset, image_point_t src[4], image_point_t dst[4])
+{
+	float modsize = image_point_distance(ring[(0 + offset) % 4], ring[(1 + offset) % 4]) / 7.0;
+	float d = 0.5 / modsize;
+
+	src[0] = POINT(-0.5 + d, -0.5 + d); // left--top of the ring
+	src[1] = POINT(6.5 - d, -0.5 + d); // right-top of the ring
+	src[2] = POINT(6.5 - d, 6.5 - d); // right-bottom of the ring
+	src[3] = POINT(-0.5 + d, 6.5 - d); // left--bottom of the ring
+
+	dst[0] = ring[(0 + offset) % 4];
+	dst[1] = ring[(1 + offset) % 4];
+	dst[2] = ring[(2 + offset) % 4];
+	dst[3] = ring[(3 + offset) % 4];
+}
+
+void qrean_detector_perspective_setup_by_qr_finder_pattern_ring_corners(
+	qrean_detector_perspective_t *warp, image_point_t ring[4], int offset)
+{
+	ring_corners_correspondence(ring, offset, warp->src, warp->dst);
+	warp->h = create_image_transform_matrix(warp->src, warp->dst);
+
+	qrean_on_read_pixel(warp->qrean, qrean_detector_perspective_read_image_pixel, warp);
+	qrean_on_write_pixel(warp->qrean, qrean_detector_perspective_write_image_pixel, warp);
+}
+
+// alignment pattern search, around the predicted position
+#define ALIGNMENT_SEARCH_MODULES (4) // half size of the window
+#define ALIGNMENT_MAX_CANDIDATES (8)
+#define ALIGNMENT_MAX_TRIES      (3) // for large versions, the neighbors are tried if the last one doesn't fit
+
+// measures the dark module on (x, y) and the light ring around it, along (dx, dy)
+// returns the center of the dark module along the axis, or NAN
+static float cross_check_alignment(image_bitmap_t *img, int x, int y, int dx, int dy, float module_size)
+{
+	int limit = ceil(module_size * 2);
+	int dark[2] = { 0, 0 }, light[2] = { 0, 0 };
+
+	if (read_pixel_class_at(img, NULL, x, y) != PIXEL_CLASS_DARK) return NAN;
+
+	for (int d = 0; d < 2; d++) {
+		int sign = d ? 1 : -1;
+		int n = 1;
+		while (n <= limit && read_pixel_class_at(img, NULL, x + sign * n * dx, y + sign * n * dy) == PIXEL_CLASS_DARK) n++;
+		dark[d] = n - 1;
+		while (n <= limit * 2 && read_pixel_class_at(img, NULL, x + sign * n * dx, y + sign * n * dy) == PIXEL_CLASS_LIGHT) n++;
+		light[d] = n - 1 - dark[d];
+		if (n > limit * 2) return NAN; // no dark ring
+	}
+
+	float size = dark[0] + dark[1] + 1;
+	if (size < module_size * 0.5 || module_size * 1.8 < size) return NAN;
+	for (int d = 0; d < 2; d++) {
+		if (light[d] < module_size * 0.4 || module_size * 2.0 < light[d]) return NAN;
+	}
+
+	return (dx ? x : y) + (dark[1] - dark[0]) / 2.0f;
+}
+
+// finds the centers of the alignment pattern candidates, the nearest first
+static int find_alignment_patterns(
+	image_bitmap_t *img, image_point_t predicted, float module_size, image_point_t found[ALIGNMENT_MAX_CANDIDATES])
+{
+	int num = 0;
+	float dists[ALIGNMENT_MAX_CANDIDATES];
+	int r = ceil(module_size * ALIGNMENT_SEARCH_MODULES);
+	int px = round(POINT_X(predicted));
+	int py = round(POINT_Y(predicted));
+
+	for (int y = py - r; y <= py + r; y++) {
+		if (y < 0 || y >= (int)img->height) continue;
+
+		runlength_t rl = create_runlength();
+		for (int x = px - r; x <= px + r + 1; x++) {
+			int v = read_pixel_class_at(img, NULL, x, y);
+			if (!runlength_push_value(&rl, v) || v != PIXEL_CLASS_DARK) continue;
+
+			// light, dark, light in 1:1:1, just before this dark
+			if (!runlength_match_ratio(&rl, 1, 1, 1, 0, -1)) continue;
+			int len = runlength_sum(&rl, 1, 3);
+			if (len < module_size * 1.5 || module_size * 4.5 < len) continue;
+
+			int mx = x - runlength_get_count(&rl, 1) - (runlength_get_count(&rl, 2) + 1) / 2;
+			float cy = cross_check_alignment(img, mx, y, 0, 1, module_size);
+			if (isnan(cy)) continue;
+			float cx = cross_check_alignment(img, mx, round(cy), 1, 0, module_size);
+			if (isnan(cx)) continue;
+
+			image_point_t c = POINT(cx, cy);
+			float dist = image_point_distance(c, predicted);
+
+			// the same pattern is hit on the multiple rows
+			int dup = 0;
+			for (int i = 0; i < num && !dup; i++) dup = image_point_distance(found[i], c) < module_size;
+			if (dup) continue;
+
+			// insert in the order of the distance, dropping the farthest
+			int i = num < ALIGNMENT_MAX_CANDIDATES ? num++ : num - 1;
+			if (i == num - 1 && num == ALIGNMENT_MAX_CANDIDATES && dists[i] <= dist) continue;
+			for (; i > 0 && dists[i - 1] > dist; i--) {
+				found[i] = found[i - 1];
+				dists[i] = dists[i - 1];
+			}
+			found[i] = c;
+			dists[i] = dist;
+		}
+	}
+
+	return num;
+}
+
+int qrean_detector_perspective_fit_for_qr(qrean_detector_perspective_t *warp)
+{
+	int N = qrspec_get_alignment_num(warp->qrean->qr.version);
+	int max_tries = warp->qrean->qr.version >= QR_VERSION_7 ? ALIGNMENT_MAX_TRIES : 1;
+
+	// from the bottom-right one, skipping the ones on the timing patterns, which are in line with the finders
+	for (int i = N - 1, tries = 0; i >= 0 && tries < max_tries; i--) {
+		int cx = qrspec_get_alignment_position_x(warp->qrean->qr.version, i);
+		int cy = qrspec_get_alignment_position_y(warp->qrean->qr.version, i);
+		if (cx == 6 || cy == 6) continue;
+		tries++;
+
+		image_point_t c = image_point_transform(POINT(cx, cy), warp->h);
+		image_point_t next = image_point_transform(POINT(cx + 1, cy), warp->h);
+		float module_size = image_point_distance(next, c);
+		if (!(module_size >= 1)) continue;
+
+		image_point_t found[ALIGNMENT_MAX_CANDIDATES];
+		int num = find_alignment_patterns(warp->img, c, module_size, found);
+
+		for (int j = 0; j < num; j++) {
+			qrean_detector_perspective_t backup = *warp;
+
+			warp->src[2] = POINT(cx, cy);
+			warp->dst[2] = found[j];
+			warp->h = create_image_transform_matrix(warp->src, warp->dst);
+
+			if (qrean_read_qr_alignment_pattern(warp->qrean, i) < 10) return 1;
+
+			// restore if it doesn't fit
+			*warp = backup;
+		}
+	}
+
+	return 0;
+}
+
+// versions to try around the estimated one
+#define QR_VERSION_WINDOW (2)
+
+// module size, by the area of the 3x3 inner block, which is steadier than the ring corners
+static float qr_finder_module_size(qrean_detector_qr_finder_candidate_t *candidate)
+{
+	return sqrtf(candidate->area / 9.0f);
+}
+
+// the centers of the finder patterns are 7 modules inside of the symbol width
+static float estimate_qr_version(qrean_detector_qr_finder_candidate_t *c0, qrean_detector_qr_finder_candidate_t *c1,
+	qrean_detector_qr_finder_candidate_t *c2)
+{
+	float modsize = (qr_finder_module_size(c0) + qr_finder_module_size(c1) + qr_finder_module_size(c2)) / 3;
+	float dist = (image_point_distance(c0->center, c1->center) + image_point_distance(c0->center, c2->center)) / 2;
+	return (dist / modsize + 7 - 17) / 4;
+}
+
+// tolerances of the finder triples, against the perspective
+#define FINDER_TRIPLE_MAX_MODSIZE_RATIO (2.0)
+#define FINDER_TRIPLE_MAX_LEG_RATIO     (2.0)
+#define FINDER_TRIPLE_MAX_COS           (0.7) // about 45 degrees off from the right angle
+#define FINDER_TRIPLE_MIN_MODULES       (10) // 14 at version 1
+#define FINDER_TRIPLE_MAX_MODULES       (230) // 170 at version 40
+
+// returns 1 if the triple could be the finder patterns of a symbol
+// the order is set to the corner, the next one in clockwise, and the last one, as the centers setup expects
+static int order_qr_finder_triple(qrean_detector_qr_finder_candidate_t *candidates, int i, int j, int k, int order[3])
+{
+	float m[3] = {
+		qr_finder_module_size(&candidates[i]),
+		qr_finder_module_size(&candidates[j]),
+		qr_finder_module_size(&candidates[k]),
+	};
+	float mmin = fminf(m[0], fminf(m[1], m[2]));
+	float mmax = fmaxf(m[0], fmaxf(m[1], m[2]));
+	if (!(mmin > 0) || mmax > mmin * FINDER_TRIPLE_MAX_MODSIZE_RATIO) return 0;
+
+	// the corner is the opposite of the longest side
+	int idx[3] = { i, j, k };
+	float d[3]; // length of the side opposite of idx[n]
+	for (int n = 0; n < 3; n++) d[n] = image_point_distance(candidates[idx[(n + 1) % 3]].center, candidates[idx[(n + 2) % 3]].center);
+	int c = d[0] >= d[1] && d[0] >= d[2] ? 0 : d[1] >= d[2] ? 1 : 2;
+
+	image_point_t o = candidates[idx[c]].center;
+	image_point_t p = candidates[idx[(c + 1) % 3]].center;
+	image_point_t q = candidates[idx[(c + 2) % 3]].center;
+	float ax = POINT_X(p) - POINT_X(o), ay = POINT_Y(p) - POINT_Y(o);
+	float bx = POINT_X(q) - POINT_X(o), by = POINT_Y(q) - POINT_Y(o);
+	float la = d[(c + 2) % 3], lb = d[(c + 1) % 3];
+
+	if (fmaxf(la, lb) > fminf(la, lb) * FINDER_TRIPLE_MAX_LEG_RATIO) return 0;
+	if (fabsf(ax * bx + ay * by) > la * lb * FINDER_TRIPLE_MAX_COS) return 0;
+
+	float modsize = (m[0] + m[1] + m[2]) / 3;
+	if (fminf(la, lb) < modsize * FINDER_TRIPLE_MIN_MODULES || fmaxf(la, lb) > modsize * FINDER_TRIPLE_MAX_MODULES) return 0;
+
+	// clockwise on the image, as the y-axis goes down
+	int cw = ax * by - ay * bx > 0;
+	order[0] = idx[c];
+	order[1] = idx[(c + (cw ? 1 : 2)) % 3];
+	order[2] = idx[(c + (cw ? 2 : 1)) % 3];
+
+	return 1;
+}
+
+// the neighbors are looked up on a uniform grid of the centers, by the rings of the cells around
+#define FINDER_GRID_CELL_MODULES (32)
+#define FINDER_GRID_MAX_CELLS    (4) // per candidate
+
+// keeps the nearest neighbors, sorted, which could be in a triple with the candidate
+static void add_candidate_neighbor(qrean_detector_qr_finder_candidate_t *candidates, int i, int j, float *dists)
+{
+	qrean_detector_qr_finder_candidate_t *candidate = &candidates[i];
+	float mi = qr_finder_module_size(candidate), mj = qr_finder_module_size(&candidates[j]);
+	if (i == j || fmaxf(mi, mj) > fminf(mi, mj) * FINDER_TRIPLE_MAX_MODSIZE_RATIO) return;
+
+	float dist = image_point_distance(candidate->center, candidates[j].center);
+	if (dist > mi * FINDER_TRIPLE_MAX_MODSIZE_RATIO * FINDER_TRIPLE_MAX_MODULES) return;
+
+	int n = candidate->num_neighbors;
+	if (n == MAX_CANDIDATE_NEIGHBORS) {
+		if (dist >= dists[n - 1]) return;
+		n--;
+	}
+	for (; n > 0 && dists[n - 1] > dist; n--) {
+		candidate->neighbors[n] = candidate->neighbors[n - 1];
+		dists[n] = dists[n - 1];
+	}
+	candidate->neighbors[n] = j;
+	dists[n] = dist;
+	if (candidate->num_neighbors < MAX_CANDIDATE_NEIGHBORS) candidate->num_neighbors++;
+}
+
+// finds the neighbors of all candidates, in linear time of the number of them if the grid is available
+static void group_candidates(qrean_detector_t *detector, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates)
+{
+	if (num_candidates <= 0) return;
+
+	float minx = INFINITY, miny = INFINITY, maxx = -INFINITY, maxy = -INFINITY, modsize = 0;
+	for (int i = 0; i < num_candidates; i++) {
+		candidates[i].num_neighbors = 0;
+		minx = fminf(minx, POINT_X(candidates[i].center));
+		miny = fminf(miny, POINT_Y(candidates[i].center));
+		maxx = fmaxf(maxx, POINT_X(candidates[i].center));
+		maxy = fmaxf(maxy, POINT_Y(candidates[i].center));
+		modsize += qr_finder_module_size(&candidates[i]) / num_candidates;
+	}
+
+	// the cells get larger, if there would be too many of them
+	float cell = fmaxf(modsize * FINDER_GRID_CELL_MODULES, 1);
+	int cols, rows;
+	for (;; cell *= 2) {
+		cols = (int)((maxx - minx) / cell) + 1;
+		rows = (int)((maxy - miny) / cell) + 1;
+		if ((float)cols * rows <= (float)num_candidates * FINDER_GRID_MAX_CELLS + 1) break;
+	}
+	int num_cells = cols * rows;
+
+	float dists[MAX_CANDIDATE_NEIGHBORS];
+	qrean_detector_scratch_t *scratch = &detector->scratch;
+	if (!scratch_reserve((void **)&scratch->grid, &scratch->max_grid, num_cells + 1 + num_candidates, sizeof(int), 1024)) {
+		// all pairs, for the few candidates without malloc
+		for (int i = 0; i < num_candidates; i++) {
+			for (int j = 0; j < num_candidates; j++) add_candidate_neighbor(candidates, i, j, dists);
+		}
+		return;
+	}
+
+#define CANDIDATE_CELL_X(c) ((int)((POINT_X((c).center) - minx) / cell))
+#define CANDIDATE_CELL_Y(c) ((int)((POINT_Y((c).center) - miny) / cell))
+
+	// counting sort by the cell; the candidates in the cell n are items[starts[n]] to items[starts[n + 1] - 1]
+	int *starts = scratch->grid;
+	int *items = scratch->grid + num_cells + 1;
+	memset(starts, 0, sizeof(int) * (num_cells + 1));
+	for (int i = 0; i < num_candidates; i++) starts[CANDIDATE_CELL_Y(candidates[i]) * cols + CANDIDATE_CELL_X(candidates[i]) + 1]++;
+	for (int n = 0; n < num_cells; n++) starts[n + 1] += starts[n];
+	for (int i = 0; i < num_candidates; i++) {
+		int n = CANDIDATE_CELL_Y(candidates[i]) * cols + CANDIDATE_CELL_X(candidates[i]);
+		items[starts[n]++] = i;
+	}
+	for (int n = num_cells; n > 0; n--) starts[n] = starts[n - 1];
+	starts[0] = 0;
+
+	for (int i = 0; i < num_candidates; i++) {
+		qrean_detector_qr_finder_candidate_t *candidate = &candidates[i];
+		float radius = qr_finder_module_size(candidate) * FINDER_TRIPLE_MAX_MODSIZE_RATIO * FINDER_TRIPLE_MAX_MODULES;
+		int cx = CANDIDATE_CELL_X(*candidate), cy = CANDIDATE_CELL_Y(*candidate);
+
+		// the ring r is at least (r - 1) cells away, so stop once it's farther than the farthest one kept
+		for (int r = 0; r < cols || r < rows; r++) {
+			float near = (r - 1) * cell;
+			if (near > radius) break;
+			if (candidate->num_neighbors == MAX_CANDIDATE_NEIGHBORS && near > dists[MAX_CANDIDATE_NEIGHBORS - 1]) break;
+
+			for (int y = cy - r; y <= cy + r; y++) {
+				if (y < 0 || y >= rows) continue;
+				int step = (y == cy - r || y == cy + r) ? 1 : r * 2;
+				for (int x = cx - r; x <= cx + r; x += step > 0 ? step : 1) {
+					if (x < 0 || x >= cols) continue;
+					int n = y * cols + x;
+					for (int m = starts[n]; m < starts[n + 1]; m++) add_candidate_neighbor(candidates, i, items[m], dists);
+				}
+			}
+		}
+	}
+
+#undef CANDIDATE_CELL_X
+#undef CANDIDATE_CELL_Y
+}
+
+// enumerates the triples, with the corner and two of its neighbors, nearest first
+#define create_finder_triple_iterator() ((qrean_detector_finder_triple_iterator_t) { .i = 0, .a = 0, .b = 1 })
+
+static int finder_triple_iterator_next(
+	qrean_detector_finder_triple_iterator_t *it, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates, int order[3])
+{
+	for (; it->i < num_candidates; it->i++, it->a = 0, it->b = 1) {
+		qrean_detector_qr_finder_candidate_t *corner = &candidates[it->i];
+		if (corner->kind & QREAN_DETECTOR_CANDIDATE_USED) continue;
+
+		for (; it->b < corner->num_neighbors; it->b++, it->a = 0) {
+			int k = corner->neighbors[it->b];
+			if (candidates[k].kind & QREAN_DETECTOR_CANDIDATE_USED) continue;
+
+			while (it->a < it->b) {
+				int j = corner->neighbors[it->a++];
+				if (candidates[j].kind & QREAN_DETECTOR_CANDIDATE_USED) continue;
+				if (order_qr_finder_triple(candidates, it->i, j, k, order) && order[0] == it->i) return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// the timing patterns leave the finder pattern at the module 7, along the edges of the symbol
+#define TIMING_MIN_MODULES  (4) // M1
+#define TIMING_MQR_MODULES  (11) // M4, and the quiet zone next to it
+#define TIMING_MAX_MODULES  (16)
+
+// counts the modules in the light-dark alternation, from the module 7 of the row (or column) 0
+static int count_timing_modules(image_bitmap_t *img, image_transform_matrix_t h, int dx, int dy)
+{
+	int n;
+	for (n = 0; n < TIMING_MAX_MODULES; n++) {
+		image_point_t p = image_point_transform(POINT(dx * (7 + n), dy * (7 + n)), h);
+		if (read_dark_pixel(img, p) != (n % 2)) break;
+	}
+	return n;
+}
+
+void qrean_detector_classify_candidates(
+	qrean_detector_t *detector, image_bitmap_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates)
+{
+	for (int i = 0; i < num_candidates; i++) {
+		candidates[i].kind = 0;
+		candidates[i].mqr_offset = -1;
+		candidates[i].rmqr_offset = -1;
+	}
+
+	group_candidates(detector, candidates, num_candidates);
+
+	qrean_detector_finder_triple_iterator_t it = create_finder_triple_iterator();
+	int idx[3];
+	while (finder_triple_iterator_next(&it, candidates, num_candidates, idx)) {
+		for (int n = 0; n < 3; n++) candidates[idx[n]].kind |= QREAN_DETECTOR_CANDIDATE_TRIPLE;
+	}
+
+	// the orientation is where the timing patterns leave the finder to the right (and down for mQR) in the symbol
+	// the longest alternation is taken, the modules of a symbol next to it may continue it on the other sides
+	for (int i = 0; i < num_candidates; i++) {
+		// rMQR has a single finder, the data of the QR around a corner of a triple may look like its timing pattern
+		int triple = candidates[i].kind & QREAN_DETECTOR_CANDIDATE_TRIPLE;
+		int longest_rmqr = 0;
+		int longest_mqr = 0;
+		for (int c = 0; c < 4; c++) {
+			image_point_t from[4], to[4];
+			ring_corners_correspondence(candidates[i].corners, c, from, to);
+			image_transform_matrix_t h = create_image_transform_matrix(from, to);
+
+			int row = count_timing_modules(src, h, 1, 0);
+			if (row > TIMING_MQR_MODULES) {
+				if (!triple && row > longest_rmqr) {
+					longest_rmqr = row;
+					candidates[i].kind |= QREAN_DETECTOR_CANDIDATE_RMQR;
+					candidates[i].rmqr_offset = c;
+				}
+			} else if (row >= TIMING_MIN_MODULES) {
+				int col = count_timing_modules(src, h, 0, 1);
+				if (TIMING_MIN_MODULES <= col && col <= TIMING_MQR_MODULES && row + col > longest_mqr) {
+					longest_mqr = row + col;
+					candidates[i].kind |= QREAN_DETECTOR_CANDIDATE_MQR;
+					candidates[i].mqr_offset = c;
+				}
+			}
+		}
+		int kind = candidates[i].kind;
+		detector_debug_printf(detector, "Candidate %d: %s%s%s (%d, %d)\n", i, kind & QREAN_DETECTOR_CANDIDATE_TRIPLE ? "triple " : "",
+			kind & QREAN_DETECTOR_CANDIDATE_MQR ? "mQR " : "", kind & QREAN_DETECTOR_CANDIDATE_RMQR ? "rMQR" : "", candidates[i].mqr_offset,
+			candidates[i].rmqr_offset);
+	}
+}
+
+// the point inside of the symbol region
+static int is_inside_region(image_transform_matrix_t h, int width, int height, image_point_t p)
+{
+	image_point_t quad[4] = {
+		image_point_transform(POINT(-0.5f, -0.5f), h),
+		image_point_transform(POINT(width - 0.5f, -0.5f), h),
+		image_point_transform(POINT(width - 0.5f, height - 0.5f), h),
+		image_point_transform(POINT(-0.5f, height - 0.5f), h),
+	};
+
+	int pos = 0, neg = 0;
+	for (int n = 0; n < 4; n++) {
+		image_point_t a = quad[n], b = quad[(n + 1) % 4];
+		float cross = (POINT_X(b) - POINT_X(a)) * (POINT_Y(p) - POINT_Y(a)) - (POINT_Y(b) - POINT_Y(a)) * (POINT_X(p) - POINT_X(a));
+		pos |= cross > 0;
+		neg |= cross < 0;
+	}
+	return !(pos && neg);
+}
+
+// the candidates inside of the symbol region are done, which also drops the duplicates of it
+static void use_candidates_in_region(image_transform_matrix_t h, int width, int height,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates)
+{
+	for (int i = 0; i < num_candidates; i++) {
+		if (is_inside_region(h, width, height, candidates[i].center)) candidates[i].kind |= QREAN_DETECTOR_CANDIDATE_USED;
+	}
+}
+
+static void use_candidates_in_symbol(
+	qrean_detector_perspective_t *warp, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates)
+{
+	use_candidates_in_region(warp->h, warp->qrean->canvas.symbol_width, warp->qrean->canvas.symbol_height, candidates, num_candidates);
+}
+
+// the finders are tried only by the decoders they are classified for, and the unclassified ones by all
+// the ones only in a triple are left unclassified, to be tried as a single finder if the triple is not decoded
+static int is_candidate_for(qrean_detector_qr_finder_candidate_t *candidate, int kind)
+{
+	if (candidate->kind & QREAN_DETECTOR_CANDIDATE_USED) return 0;
+	if (!(candidate->kind & ~QREAN_DETECTOR_CANDIDATE_TRIPLE)) return 1;
+	return candidate->kind & kind;
+}
+
+// the ring corner offsets to try, in [*first, *last]
+static void candidate_offsets(int offset, int *first, int *last)
+{
+	*first = offset >= 0 ? offset : 0;
+	*last = offset >= 0 ? offset : 3;
+}
+
+// tries the versions around the estimated one on the triple
+static int try_decode_qr_triple(qrean_detector_t *detector, image_bitmap_t *src, qrean_detector_qr_finder_candidate_t *candidates,
+	int num_candidates, int idx[3], void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	image_point_t points[] = {
+		candidates[idx[0]].center,
+		candidates[idx[1]].center,
+		candidates[idx[2]].center,
+	};
+
+	float estimated = estimate_qr_version(&candidates[idx[0]], &candidates[idx[1]], &candidates[idx[2]]);
+	int window = QR_VERSION_WINDOW + estimated / 10;
+	if (estimated < 1 - window || 40 + window < estimated) return 0;
+
+	// nearest first, and the one read from the version info if any
+	int versions[QR_VERSION_40 + 1];
+	int num_versions = 0;
+	int jumped = 0;
+	int base = QR_VERSION_1 - 1 + (int)roundf(estimated);
+	for (int n = 0; n <= window * 2; n++) {
+		int version = base + (n % 2 ? (n + 1) / 2 : -n / 2);
+		if (QR_VERSION_1 <= version && version <= QR_VERSION_40) versions[num_versions++] = version;
+	}
+
+	qrean_t qrean = create_qrean(QREAN_CODE_TYPE_QR);
+
+	for (int n = 0; n < num_versions; n++) {
+		int version = versions[n];
+		qrean_set_qr_version(&qrean, (qr_version_t)version);
+
+		qrean_detector_perspective_t warp = create_qrean_detector_perspective(detector, &qrean, src);
+		qrean_detector_perspective_setup_by_qr_finder_pattern_centers(&warp, points, 0);
+
+		if (qrean_read_qr_finder_pattern(&qrean, -1) > 10) continue;
+
+		qrean_detector_perspective_fit_for_qr(&warp);
+		qrean_detector_perspective_sample(&warp);
+
+		if (qrean_set_qr_format_info(&qrean, qrean_read_qr_format_info(&qrean, -1))) {
+			qr_version_t read = qrean_read_qr_version(&qrean);
+			if (read != version) {
+				// the version info is at the same place from the finder patterns, so jump to it once
+				if (read >= QR_VERSION_7 && !jumped) {
+					jumped = 1;
+					int tried = 0;
+					for (int m = 0; m < num_versions; m++) tried |= versions[m] == read;
+					if (!tried) versions[num_versions++] = read;
+				}
+				continue;
+			}
+
+			if (qrean_fix_errors(&qrean) >= 0) {
+				detector_debug_printf(detector, "Detected as QR version: %s\n", qrspec_get_version_string(qrean.qr.version));
+				on_found(&warp, opaque);
+				found++;
+				use_candidates_in_symbol(&warp, candidates, num_candidates);
+				break;
+			}
+		}
+	}
+
+	qrean_destroy(&qrean);
+
+	return found;
+}
+
+int qrean_detector_try_decode_qr_bitmap(qrean_detector_t *detector, image_bitmap_t *src,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	if (num_candidates > 0 && candidates[0].num_neighbors < 0) group_candidates(detector, candidates, num_candidates);
+
+	// try the triples of the neighbors, which pass the geometric filter
+	qrean_detector_finder_triple_iterator_t it = create_finder_triple_iterator();
+	int idx[3];
+	while (finder_triple_iterator_next(&it, candidates, num_candidates, idx)) {
+		found += try_decode_qr_triple(detector, src, candidates, num_candidates, idx, on_found, opaque);
+	}
+
+	return found;
+}
+
+static int try_decode_tqr_triple(qrean_detector_t *detector, image_bitmap_t *src, qrean_detector_qr_finder_candidate_t *candidates,
+	int num_candidates, int idx[3], void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	image_point_t points[] = {
+		candidates[idx[0]].center,
+		candidates[idx[1]].center,
+		candidates[idx[2]].center,
+	};
+
+	qrean_t qrean = create_qrean(QREAN_CODE_TYPE_TQR);
+	qrean_set_qr_version(&qrean, QR_VERSION_TQR);
+	qrean_set_qr_maskpattern(&qrean, QR_MASKPATTERN_0);
+
+	qrean_detector_perspective_t warp = create_qrean_detector_perspective(detector, &qrean, src);
+	qrean_detector_perspective_setup_by_qr_finder_pattern_centers(&warp, points, 2);
+
+	if (qrean_read_qr_finder_pattern(&qrean, -1) <= 10) {
+		// qrean_detector_perspective_fit_for_qr(&warp);
+		detector_debug_printf(detector, "Detected as tQR\n");
+		qrean_detector_perspective_sample(&warp);
+
+		if (qrean_fix_errors(&qrean) >= 0) {
+			on_found(&warp, opaque);
+			found++;
+			use_candidates_in_symbol(&warp, candidates, num_candidates);
+		}
+	}
+
+	qrean_destroy(&qrean);
+
+	return found;
+}
+
+int qrean_detector_try_decode_tqr_bitmap(qrean_detector_t *detector, image_bitmap_t *src,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	if (num_candidates > 0 && candidates[0].num_neighbors < 0) group_candidates(detector, candidates, num_candidates);
+
+	// try the triples of the neighbors, which pass the geometric filter
+	qrean_detector_finder_triple_iterator_t it = create_finder_triple_iterator();
+	int idx[3];
+	while (finder_triple_iterator_next(&it, candidates, num_candidates, idx)) {
+		found += try_decode_tqr_triple(detector, src, candidates, num_candidates, idx, on_found, opaque);
+	}
+
+	return found;
+}
+
+// finds the farthest dark pixel, within the angle
+// used where the corner is not on a blob of its own
+static image_point_t find_corner(image_bitmap_t *img, image_point_t c, float max_dist, float center_theta, float delta_theta)
+{
+	for (float r = max_dist; r > 0; r -= 0.2) {
+		float theta;
+		for (theta = center_theta - delta_theta; theta <= center_theta + delta_theta; theta += 1 / max_dist) {
+			float x = c.x + r * cos(theta);
+			float y = c.y + r * sin(theta);
+			if (read_dark_pixel(img, POINT(x, y))) {
+				return POINT(x, y);
+			}
+		}
+	}
+	return c;
+}
+
+// finds the corner of the dark blob on `p`, in the direction from the center of the blob
+static image_point_t find_blob_corner(qrean_detector_perspective_t *warp, image_point_t p, float modsize)
+{
+	image_bitmap_t *painted = &warp->detector->scratch.painted;
+	image_paint_result_t result = image_bitmap_paint_bounded(painted, warp->img, p, 1, scratch_stack(&warp->detector->scratch), 0);
+	image_point_t c = image_extent_center(&result.extent);
+	if (!result.area) return c;
+
+	float dist = image_point_distance(c, p) * 1.2;
+	corner_finder_t cf = create_corner_finder(c, image_point_sub(p, c), modsize * 1.5 / dist);
+	cf.tolerance = 0;
+	cf.outset = 0.5; // on the outer edge of the pixel, as the blob is hit from outside
+	trace_blob_corners(&cf, painted, result.extent);
+	image_bitmap_clear_extent(painted, result.extent);
+
+	image_point_t corner = corner_finder_get(&cf, 0);
+	return POINT_IS_INVALID(corner) ? c : corner;
+}
+
+static image_point_t find_rmqr_corner_finder_pattern(
+	qrean_detector_perspective_t *warp, image_point_t a, float angle, float dist, int corner_size)
+{
+	float modsize = image_point_distance(warp->dst[0], warp->dst[1]) / 7;
+
+	image_point_t last_p = POINT_INVALID;
+	int found = 0;
+	float delta = 1 / dist;
+
+	if (delta < 0.01) delta = 0.01; // XXX:
+	for (float theta = angle - M_PI / 32; theta <= angle + M_PI / 32; theta += delta) {
+		runlength_t rl = create_runlength();
+		for (int i = 0; i < dist * 2; i += 1) {
+			image_point_t p = POINT(a.x + i * cos(theta), a.y + i * sin(theta));
+			bit_t pix = read_dark_pixel(warp->img, p);
+			if (runlength_push_value(&rl, pix)) {
+				int ratio = round(runlength_get_count(&rl, 1) / modsize);
+				if (ratio != 0 && ratio != 5 && ratio != 6 && ratio != 7 && ratio != 1 && ratio != 3) {
+					break;
+				}
+			}
+
+			if (runlength_match_ratio(&rl, 1, 1, 1, 1, 1, corner_size, 2, -1) && !pix) {
+				float n = i - runlength_get_count(&rl, 0) - runlength_get_count(&rl, 0) / 2.0;
+				image_point_t p = POINT(a.x + n * cos(theta), a.y + n * sin(theta));
+
+				if (!read_dark_pixel(warp->img, p)) continue;
+
+				if (found < n) {
+					found = n;
+					last_p = find_blob_corner(warp, p, modsize);
+				}
+			}
+		}
+	}
+
+	return last_p;
+}
+
+int qrean_detector_perspective_fit_for_rmqr(qrean_detector_perspective_t *warp)
+{
+	image_point_t a = image_point_transform(POINT(0, 0), warp->h);
+	image_point_t b = image_point_transform(POINT(warp->qrean->canvas.symbol_width - 1, 0), warp->h);
+	image_point_t c = image_point_transform(POINT(warp->qrean->canvas.symbol_width - 1, warp->qrean->canvas.symbol_height - 1), warp->h);
+	image_point_t d = image_point_transform(POINT(0, warp->qrean->canvas.symbol_height - 1), warp->h);
+	float modsize = image_point_distance(warp->dst[0], warp->dst[1]) / 7;
+	float delta = 0.5 / modsize;
+
+	image_point_t rt = find_rmqr_corner_finder_pattern(warp, a, image_point_angle(a, b), image_point_distance(a, b), 3);
+	image_point_t lb = find_rmqr_corner_finder_pattern(warp, a, image_point_angle(a, d), image_point_distance(a, d), 3);
+	if (POINT_IS_INVALID(lb)) {
+		image_point_t center = image_point_transform(POINT(3.5, 3.5), warp->h);
+		float dist = image_point_distance(center, d) * 1.2;
+		lb = find_corner(warp->img, center, dist, image_point_angle(center, d), modsize * 1.5 / dist);
+	}
+	image_point_t rb = find_rmqr_corner_finder_pattern(warp, lb, image_point_angle(d, c), image_point_distance(d, c), 5);
+
+	qrean_detector_perspective_t backup = *warp;
+
+	// the left-top one stays on the ring corner, as it's set up
+
+	warp->src[1] = POINT(warp->qrean->canvas.symbol_width - 0.5 - delta, -0.5 + delta);
+	warp->dst[1] = rt;
+
+	warp->src[2] = POINT(warp->qrean->canvas.symbol_width - 0.5 - delta, warp->qrean->canvas.symbol_height - 0.5 - delta);
+	warp->dst[2] = rb;
+
+	if (lb.x != d.x || lb.y != d.y) {
+		warp->src[3] = POINT(-0.5 + delta, warp->qrean->canvas.symbol_height - 0.5 - delta);
+		warp->dst[3] = lb;
+	}
+	warp->h = create_image_transform_matrix(warp->src, warp->dst);
+
+	int score = qrean_read_qr_corner_finder_pattern(warp->qrean, -1);
+	if (score < 10) return 1;
+
+	// restore if it doesn't fit
+	*warp = backup;
+	return 0;
+}
+
+static int try_decode_rmqr_candidate(qrean_detector_t *detector, image_bitmap_t *src, qrean_detector_qr_finder_candidate_t *candidates,
+	int num_candidates, int idx, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	int first, last;
+	candidate_offsets(candidates[idx].kind ? candidates[idx].rmqr_offset : -1, &first, &last);
+	for (int c = first; c <= last && is_candidate_for(&candidates[idx], QREAN_DETECTOR_CANDIDATE_RMQR); c++) {
+		qrean_t qrean = create_qrean(QREAN_CODE_TYPE_RMQR);
+		qrean_set_qr_version(&qrean, QR_VERSION_R17x139); // max size
+
+		qrean_detector_perspective_t warp = create_qrean_detector_perspective(detector, &qrean, src);
+		qrean_detector_perspective_setup_by_qr_finder_pattern_ring_corners(&warp, candidates[idx].corners, c);
+
+		if (qrean_set_qr_format_info(&qrean, qrean_read_qr_format_info(&qrean, -1))) {
+			detector_debug_printf(detector, "Detected as rMQR version: %s\n", qrspec_get_version_string(qrean.qr.version));
+
+			qrean_detector_perspective_fit_for_rmqr(&warp);
+			qrean_detector_perspective_sample(&warp);
+
+			if (qrean_fix_errors(&qrean) >= 0) {
+				on_found(&warp, opaque);
+				found++;
+				use_candidates_in_symbol(&warp, candidates, num_candidates);
+			}
+		}
+
+		qrean_destroy(&qrean);
+	}
+
+	return found;
+}
+
+int qrean_detector_try_decode_rmqr_bitmap(qrean_detector_t *detector, image_bitmap_t *src,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	for (int i = 0; i < num_candidates; i++) {
+		found += try_decode_rmqr_candidate(detector, src, candidates, num_candidates, i, on_found, opaque);
+	}
+
+	return found;
+}
+
+static int try_decode_mqr_candidate(qrean_detector_t *detector, image_bitmap_t *src, qrean_detector_qr_finder_candidate_t *candidates,
+	int num_candidates, int idx, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	int first, last;
+	candidate_offsets(candidates[idx].kind ? candidates[idx].mqr_offset : -1, &first, &last);
+	for (int c = first; c <= last && is_candidate_for(&candidates[idx], QREAN_DETECTOR_CANDIDATE_MQR); c++) {
+		qrean_t qrean = create_qrean(QREAN_CODE_TYPE_MQR);
+		qrean_set_qr_version(&qrean, QR_VERSION_M4); // max size
+
+		qrean_detector_perspective_t warp = create_qrean_detector_perspective(detector, &qrean, src);
+		qrean_detector_perspective_setup_by_qr_finder_pattern_ring_corners(&warp, candidates[idx].corners, c);
+
+		if (qrean_set_qr_format_info(&qrean, qrean_read_qr_format_info(&qrean, -1))) {
+			detector_debug_printf(detector, "Detected as mQR version: %s\n", qrspec_get_version_string(qrean.qr.version));
+			qrean_detector_perspective_sample(&warp);
+
+			if (qrean_read_qr_timing_pattern(&qrean, -1) <= 10) {
+				if (qrean_fix_errors(&qrean) >= 0) {
+					on_found(&warp, opaque);
+					found++;
+					use_candidates_in_symbol(&warp, candidates, num_candidates);
+				}
+			}
+		}
+
+		qrean_destroy(&qrean);
+	}
+
+	return found;
+}
+
+int qrean_detector_try_decode_mqr_bitmap(qrean_detector_t *detector, image_bitmap_t *src,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	for (int i = 0; i < num_candidates; i++) {
+		found += try_decode_mqr_candidate(detector, src, candidates, num_candidates, i, on_found, opaque);
+	}
+
+	return found;
+}
+
+qrean_detector_step_t create_qrean_detector_step(qrean_detector_t *detector, image_bitmap_t *src,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	qrean_detector_step_t step = {
+		.detector = detector,
+		.src = src,
+		.phase = QREAN_DETECTOR_STEP_SCAN,
+		.it = create_finder_triple_iterator(),
+		.on_found = on_found,
+		.opaque = opaque,
+	};
+	return step;
+}
+
+static void step_next_phase(qrean_detector_step_t *step)
+{
+	step->phase++;
+	step->pos = 0;
+	step->it = create_finder_triple_iterator();
+}
+
+// scans up to `max_rows` rows, and returns the rows scanned
+static int step_scan(qrean_detector_step_t *step, int max_rows)
+{
+	qrean_detector_t *detector = step->detector;
+	image_bitmap_t *src = step->src;
+
+	// the labeling and the pyramid run at once
+	if (detector->use_labeling || !scratch_fits(detector, src) || detector->pyramid_level != 0) {
+		if (detector->use_labeling) {
+			step->candidates = qrean_detector_scan_qr_finder_pattern_by_labeling(detector, src, &step->num_candidates);
+		} else {
+			step->candidates = qrean_detector_scan_qr_finder_pattern_bitmap(detector, src, &step->num_candidates);
+		}
+		step_next_phase(step);
+		return src->height;
+	}
+
+	if (step->pos == 0) image_bitmap_clear(&detector->scratch.visited);
+
+	int top = step->pos;
+	int bottom = top + max_rows < (int)src->height ? top + max_rows : (int)src->height;
+	step->num_candidates = scan_qr_finder_rows(detector, src, step->num_candidates, 0, top, src->width, bottom);
+	step->pos = bottom;
+
+	if (step->pos >= (int)src->height) {
+		// guardian
+		step->candidates = candidate_list(detector);
+		step->candidates[step->num_candidates].center = POINT(NAN, NAN);
+		step_next_phase(step);
+	}
+
+	return bottom - top;
+}
+
+int qrean_detector_step(qrean_detector_step_t *step, int max_works)
+{
+	qrean_detector_t *detector = step->detector;
+	image_bitmap_t *src = step->src;
+	int works = 0;
+	int idx[3];
+
+	while (step->phase != QREAN_DETECTOR_STEP_DONE && (max_works <= 0 || works < max_works)) {
+		switch (step->phase) {
+		case QREAN_DETECTOR_STEP_SCAN:
+			works += step_scan(step, max_works > 0 ? max_works - works : (int)src->height);
+			break;
+
+		case QREAN_DETECTOR_STEP_CLASSIFY:
+			qrean_detector_classify_candidates(detector, src, step->candidates, step->num_candidates);
+			if (step->skip) step->skip(step->opaque, step->candidates, step->num_candidates);
+			works += step->num_candidates + 1;
+			step_next_phase(step);
+			break;
+
+		// the candidates used by a symbol are skipped in the later ones
+		case QREAN_DETECTOR_STEP_QR:
+			if (!finder_triple_iterator_next(&step->it, step->candidates, step->num_candidates, idx)) {
+				step_next_phase(step);
+				break;
+			}
+			step->found += try_decode_qr_triple(detector, src, step->candidates, step->num_candidates, idx, step->on_found, step->opaque);
+			works++;
+			break;
+
+		case QREAN_DETECTOR_STEP_MQR:
+			if (step->pos >= step->num_candidates) {
+				step_next_phase(step);
+				break;
+			}
+			step->found += try_decode_mqr_candidate(
+				detector, src, step->candidates, step->num_candidates, step->pos++, step->on_found, step->opaque);
+			works++;
+			break;
+
+		case QREAN_DETECTOR_STEP_RMQR:
+			if (step->pos >= step->num_candidates) {
+				step_next_phase(step);
+				break;
+			}
+			step->found += try_decode_rmqr_candidate(
+				detector, src, step->candidates, step->num_candidates, step->pos++, step->on_found, step->opaque);
+			works++;
+			break;
+
+		case QREAN_DETECTOR_STEP_TQR:
+			if (!finder_triple_iterator_next(&step->it, step->candidates, step->num_candidates, idx)) {
+				step_next_phase(step);
+				break;
+			}
+			step->found += try_decode_tqr_triple(detector, src, step->candidates, step->num_candidates, idx, step->on_found, step->opaque);
+			works++;
+			break;
+
+		case QREAN_DETECTOR_STEP_BARCODES:
+			if (!detector->scan_barcodes || !scratch_fits(detector, src) || step->pos >= barcode_lines(src)) {
+				step_next_phase(step);
+				break;
+			}
+			if (step->pos == 0) image_bitmap_clear(&detector->scratch.visited);
+			step->found += scan_barcode_line(detector, src, step->pos++, step->on_found, step->opaque);
+			works++;
+			break;
+
+		default:
+			step->phase = QREAN_DETECTOR_STEP_DONE;
+			break;
+		}
+	}
+
+	return step->phase != QREAN_DETECTOR_STEP_DONE;
+}
+
+// `skip` marks the candidates on the symbols found already, if any
+static int detect_symbols(qrean_detector_t *detector, image_bitmap_t *src,
+	void (*skip)(void *opaque, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates),
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	qrean_detector_step_t step = create_qrean_detector_step(detector, src, on_found, opaque);
+	step.skip = skip;
+	qrean_detector_step(&step, 0);
+
+	return step.found;
+}
+
+int qrean_detector_detect(
+	qrean_detector_t *detector, image_bitmap_t *src, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	return detect_symbols(detector, src, NULL, on_found, opaque);
+}
+
+#define WITH_IMAGE_DETECTOR(src, stmt) \
+	do { \
+		CREATE_IMAGE_BITMAP(_bmp, (src)->width, (src)->height); \
+		CREATE_QREAN_DETECTOR(_detector, (src)->width, (src)->height); \
+		image_bitmap_pack(&_bmp, (src)); \
+		stmt; \
+		DESTROY_QREAN_DETECTOR(_detector); \
+		DESTROY_IMAGE_BITMAP(_bmp); \
+	} while (0)
+
+int qrean_detector_scan_barcodes(image_t *src, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	WITH_IMAGE_DETECTOR(src, found = qrean_detector_scan_barcodes_bitmap(&_detector, &_bmp, on_found, opaque));
+	return found;
+}
+
+qrean_detector_qr_finder_candidate_t *qrean_detector_scan_qr_finder_pattern(image_t *src, int *found)
+{
+	static qrean_detector_qr_finder_candidate_t candidates[MAX_CANDIDATES + 1];
+	int n = 0;
+
+	WITH_IMAGE_DETECTOR(src, {
+		qrean_detector_qr_finder_candidate_t *list = qrean_detector_scan_qr_finder_pattern_bitmap(&_detector, &_bmp, &n);
+		if (n > MAX_CANDIDATES) n = MAX_CANDIDATES;
+		memcpy(candidates, list, sizeof(candidates[0]) * n);
+	});
 
 	// guardian
-	candidates[candidx].center = POINT(NAN, NAN);
-
-	if (found) *found = candidx;
+	candidates[n].center = POINT(NAN, NAN);
 
+	if (found) *found = n;
 	return candidates;
 }
 
-qrean_detector_perspective_t create_qrean_detector_perspective(qrean_t *qrean, image_t *img)
+int qrean_detector_try_decode_qr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
 {
-	qrean_detector_perspective_t warp = {
-		.qrean = qrean,
-		.img = img,
-	};
-	return warp;
+	int found = 0;
+	WITH_IMAGE_DETECTOR(src, found = qrean_detector_try_decode_qr_bitmap(&_detector, &_bmp, candidates, num_candidates, on_found, opaque));
+	return found;
 }
 
-void qrean_detector_perspective_setup_by_qr_finder_pattern_centers(
-	qrean_detector_perspective_t *warp, image_point_t src[3], int border_offset)
+int qrean_detector_try_decode_mqr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
 {
-	warp->src[0] = POINT(3 + border_offset, 3 + border_offset); // center of the 1st keystone
-	warp->src[1] = POINT(warp->qrean->canvas.symbol_width - 4 - border_offset, 3 + border_offset); // center of the 2nd keystone
-	warp->src[2] = POINT(warp->qrean->canvas.symbol_width - 4 - border_offset,
-		warp->qrean->canvas.symbol_height - 4 - border_offset); // center of the 4th estimated pseudo keystone
-	warp->src[3] = POINT(3 + border_offset, warp->qrean->canvas.symbol_height - 4 - border_offset); // center of the 3rd keystone
+	int found = 0;
+	WITH_IMAGE_DETECTOR(src, found = qrean_detector_try_decode_mqr_bitmap(&_detector, &_bmp, candidates, num_candidates, on_found, opaque));
+	return found;
+}
 
-	warp->dst[0] = src[0];
-	warp->dst[1] = src[1];
-	warp->dst[2] = POINT(POINT_X(src[0]) + (POINT_X(src[1]) - POINT_X(src[0])) + (POINT_X(src[2]) - POINT_X(src[0])),
-		POINT_Y(src[0]) + (POINT_Y(src[1]) - POINT_Y(src[0])) + (POINT_Y(src[2]) - POINT_Y(src[0])));
-	warp->dst[3] = src[2];
+int qrean_detector_try_decode_rmqr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	WITH_IMAGE_DETECTOR(
+		src, found = qrean_detector_try_decode_rmqr_bitmap(&_detector, &_bmp, candidates, num_candidates, on_found, opaque));
+	return found;
+}
 
-	warp->h = create_image_transform_matrix(warp->src, warp->dst);
+int qrean_detector_try_decode_tqr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	int found = 0;
+	WITH_IMAGE_DETECTOR(src, found = qrean_detector_try_decode_tqr_bitmap(&_detector, &_bmp, candidates, num_candidates, on_found, opaque));
+	return found;
+}
 
-	qrean_on_read_pixel(warp->qrean, qrean_detector_perspective_read_image_pixel, warp);
-	qrean_on_write_pixel(warp->qrean, qrean_detector_perspective_write_image_pixel, warp);
+#undef WITH_IMAGE_DETECTOR
+
+qrean_detector_tracker_t create_qrean_detector_tracker(qrean_detector_t *detector)
+{
+	qrean_detector_tracker_t tracker = {
+		.detector = detector,
+		.redetect_interval = QREAN_DETECTOR_TRACKER_REDETECT_INTERVAL,
+	};
+	return tracker;
 }
 
-void qrean_detector_perspective_setup_by_qr_finder_pattern_ring_corners(
-	qrean_detector_perspective_t *warp, image_point_t ring[4], int offset)
+qrean_detector_tracker_t *new_qrean_detector_tracker(qrean_detector_t *detector)
 {
-	float modsize = image_point_distance(ring[(0 + offset) % 4], ring[(1 + offset) % 4]) / 7.0;
-	float d = 0.5 / modsize;
+#ifndef NO_MALLOC
+	qrean_detector_tracker_t *tracker = (qrean_detector_tracker_t *)malloc(sizeof(qrean_detector_tracker_t));
+	if (!tracker) return NULL;
 
-	warp->src[0] = POINT(-0.5 + d, -0.5 + d); // left--top of the ring
-	warp->src[1] = POINT(6.5 - d, -0.5 + d); // right-top of the ring
-	warp->src[2] = POINT(6.5 - d, 6.5 - d); // right-bottom of the ring
-	warp->src[3] = POINT(-0.5 + d, 6.5 - d); // left--bottom of the ring
+	*tracker = create_qrean_detector_tracker(detector);
+	return tracker;
+#else
+	return NULL;
+#endif
+}
 
-	warp->dst[0] = ring[(0 + offset) % 4];
-	warp->dst[1] = ring[(1 + offset) % 4];
-	warp->dst[2] = ring[(2 + offset) % 4];
-	warp->dst[3] = ring[(3 + offset) % 4];
+void qrean_detector_tracker_free(qrean_detector_tracker_t *tracker)
+{
+#ifndef NO_MALLOC
+	free(tracker);
+#endif
+}
 
-	warp->h = create_image_transform_matrix(warp->src, warp->dst);
+void qrean_detector_tracker_reset(qrean_detector_tracker_t *tracker)
+{
+	tracker->num_symbols = 0;
+	tracker->frames = 0;
+}
 
-	qrean_on_read_pixel(warp->qrean, qrean_detector_perspective_read_image_pixel, warp);
-	qrean_on_write_pixel(warp->qrean, qrean_detector_perspective_write_image_pixel, warp);
+#ifndef NO_CANVAS_BUFFER
+static size_t canvas_buffer_size(qrean_t *qrean)
+{
+	return ((size_t)qrean->canvas.stride * qrean->canvas.symbol_height + 7) / 8;
 }
 
-int qrean_detector_perspective_fit_for_qr(qrean_detector_perspective_t *warp)
+// FNV-1a
+static uint32_t canvas_fingerprint(qrean_t *qrean)
 {
-	CREATE_IMAGE_BY_CLONE(img, warp->img);
+	uint32_t hash = 2166136261u;
+	size_t size = canvas_buffer_size(qrean);
+	for (size_t i = 0; i < size; i++) hash = (hash ^ qrean->canvas.buffer[i]) * 16777619u;
+	return hash;
+}
+#endif
 
-	int adjusted = 0;
+static void track_symbol_update(qrean_detector_tracked_symbol_t *symbol, qrean_detector_perspective_t *warp, uint32_t fingerprint)
+{
+	qrean_t *qrean = warp->qrean;
+	symbol->type = qrean->code->type;
+	symbol->version = qrean->qr.version;
+	symbol->level = qrean->qr.level;
+	symbol->mask = qrean->qr.mask;
+	symbol->width = qrean->canvas.symbol_width;
+	symbol->height = qrean->canvas.symbol_height;
+	memcpy(symbol->src, warp->src, sizeof(symbol->src));
+	memcpy(symbol->dst, warp->dst, sizeof(symbol->dst));
+	symbol->h = warp->h;
+#ifndef NO_CANVAS_BUFFER
+	symbol->fingerprint = fingerprint;
+	memcpy(symbol->canvas, qrean->canvas.buffer, canvas_buffer_size(qrean));
+#endif
+}
 
-	int N = qrspec_get_alignment_num(warp->qrean->qr.version);
-	int i = N - 1;
-	if (i >= 0) {
-		int cx = qrspec_get_alignment_position_x(warp->qrean->qr.version, i);
-		int cy = qrspec_get_alignment_position_y(warp->qrean->qr.version, i);
+// around the predicted center of the finder pattern
+#define TRACKER_SEARCH_MODULES (7)
 
-		image_point_t c = image_point_transform(POINT(cx, cy), warp->h);
-		image_point_t next = image_point_transform(POINT(cx + 1, cy), warp->h);
-		float module_size = image_point_distance(next, c);
+// finds the finder pattern nearest to the predicted center, within the half of it
+static int track_finder_pattern(qrean_detector_t *detector, image_bitmap_t *src, image_point_t *center, float modsize)
+{
+	float r = modsize * TRACKER_SEARCH_MODULES;
+	int left = fmaxf(0, POINT_X(*center) - r);
+	int top = fmaxf(0, POINT_Y(*center) - r);
+	int right = fminf(src->width, POINT_X(*center) + r);
+	int bottom = fminf(src->height, POINT_Y(*center) + r);
+	if (left >= right || top >= bottom) return 0;
+
+	int num_candidates = scan_qr_finder_rows(detector, src, 0, left, top, right, bottom);
+	qrean_detector_qr_finder_candidate_t *candidates = candidate_list(detector);
+
+	int found = -1;
+	float nearest = modsize * 3.5f;
+	for (int i = 0; i < num_candidates; i++) {
+		float m = qr_finder_module_size(&candidates[i]);
+		if (m > modsize * FINDER_TRIPLE_MAX_MODSIZE_RATIO || m * FINDER_TRIPLE_MAX_MODSIZE_RATIO < modsize) continue;
 
-		int dist = 5;
-		for (float y = cy - dist; y < cy + dist; y += 0.2) {
-			for (float x = cx - dist; x < cx + dist; x += 0.2) {
-				image_point_t p = image_point_transform(POINT(x, y), warp->h);
-				image_point_t ring = image_point_transform(POINT(x + 1, y), warp->h);
-				if (image_read_pixel(&img, p) == 0 && image_read_pixel(&img, ring) == PIXEL(255, 255, 255)) {
-					image_paint_result_t result = image_paint(&img, ring, PIXEL(255, 0, 0));
-					if (module_size * module_size < result.area && result.area < module_size * module_size * 16) {
-						image_point_t new_center = image_extent_center(&result.extent);
+		float dist = image_point_distance(*center, candidates[i].center);
+		if (dist < nearest) {
+			nearest = dist;
+			found = i;
+		}
+	}
+	if (found < 0) return 0;
 
-						qrean_detector_perspective_t backup = *warp;
+	*center = candidates[found].center;
+	return 1;
+}
 
-						warp->src[2] = POINT(cx, cy);
-						warp->dst[2] = new_center;
-						warp->h = create_image_transform_matrix(warp->src, warp->dst);
+// decodes the symbol again, at where the finder patterns moved to from the last frame
+static int track_symbol(qrean_detector_tracker_t *tracker, qrean_detector_tracked_symbol_t *symbol, image_bitmap_t *src,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	qrean_detector_t *detector = tracker->detector;
+	int tracked = 0;
+
+	qrean_t qrean = create_qrean(symbol->type);
+	qrean_set_qr_version(&qrean, symbol->version);
+	if (symbol->type == QREAN_CODE_TYPE_TQR) qrean_set_qr_maskpattern(&qrean, QR_MASKPATTERN_0);
+
+	qrean_detector_perspective_t warp = create_qrean_detector_perspective(detector, &qrean, src);
+	memcpy(warp.src, symbol->src, sizeof(warp.src));
+	memcpy(warp.dst, symbol->dst, sizeof(warp.dst));
+	warp.h = symbol->h;
+	qrean_on_read_pixel(&qrean, qrean_detector_perspective_read_image_pixel, &warp);
+	qrean_on_write_pixel(&qrean, qrean_detector_perspective_write_image_pixel, &warp);
+
+	// the finder patterns, as the centers setup expects
+	int offset = symbol->type == QREAN_CODE_TYPE_TQR ? 2 : 0;
+	image_point_t centers[3] = {
+		POINT(3 + offset, 3 + offset),
+		POINT(symbol->width - 4 - offset, 3 + offset),
+		POINT(3 + offset, symbol->height - 4 - offset),
+	};
+	int num_finders = symbol->type == QREAN_CODE_TYPE_QR || symbol->type == QREAN_CODE_TYPE_TQR ? 3 : 1;
+	image_point_t next = POINT(4 + offset, 3 + offset); // the next module of the center
+	float modsize = image_point_distance(image_point_transform(centers[0], warp.h), image_point_transform(next, warp.h));
+
+	int moved = 1;
+	for (int i = 0; i < num_finders && moved; i++) {
+		centers[i] = image_point_transform(centers[i], warp.h);
+		moved = track_finder_pattern(detector, src, &centers[i], modsize);
+	}
+	if (moved && num_finders == 3) {
+		qrean_detector_perspective_setup_by_qr_finder_pattern_centers(&warp, centers, offset);
+		if (symbol->type == QREAN_CODE_TYPE_QR) qrean_detector_perspective_fit_for_qr(&warp);
+	} else if (moved) {
+		// the single finder pattern just moves the whole
+		image_point_t delta = image_point_sub(centers[0], image_point_transform(POINT(3, 3), warp.h));
+		for (int i = 0; i < 4; i++) warp.dst[i] = image_point_add(warp.dst[i], delta);
+		warp.h = create_image_transform_matrix(warp.src, warp.dst);
+	}
 
-						if (qrean_read_qr_alignment_pattern(warp->qrean, i) < 10) {
-							image_paint(&img, ring, PIXEL(0, 255, 0));
-							adjusted = 1;
+	// verify it's the same symbol as the last frame
+	int verified = 1;
+	if (symbol->type == QREAN_CODE_TYPE_QR || symbol->type == QREAN_CODE_TYPE_TQR) {
+		verified = qrean_read_qr_finder_pattern(&qrean, -1) <= 10;
+	}
+	if (verified && symbol->type != QREAN_CODE_TYPE_TQR) {
+		verified = qrean_set_qr_format_info(&qrean, qrean_read_qr_format_info(&qrean, -1)) && qrean.qr.version == symbol->version
+			&& qrean.qr.level == symbol->level && qrean.qr.mask == symbol->mask;
+	}
 
-							goto next;
-						}
+	if (verified) {
+		qrean_detector_perspective_sample(&warp);
 
-						// restore if it doesn't fit
-						*warp = backup;
-					}
-				}
-			}
+		uint32_t fingerprint = 0;
+#ifndef NO_CANVAS_BUFFER
+		// the same modules as the last frame are corrected to the same
+		fingerprint = canvas_fingerprint(&qrean);
+		if (symbol->fingerprint && fingerprint == symbol->fingerprint) {
+			memcpy(qrean.canvas.buffer, symbol->canvas, canvas_buffer_size(&qrean));
+			tracked = 1;
 		}
-	next:;
-	}
+#endif
+		if (!tracked) tracked = qrean_fix_errors(&qrean) >= 0;
 
-	DESTROY_IMAGE(img);
+		if (tracked) {
+			detector_debug_printf(detector, "Tracked %s version: %s\n", qrean_get_code_type_string(symbol->type),
+				qrspec_get_version_string(qrean.qr.version));
+			track_symbol_update(symbol, &warp, fingerprint);
+			on_found(&warp, opaque);
+		}
+	}
 
-	return adjusted;
+	qrean_destroy(&qrean);
+	return tracked;
 }
 
-int qrean_detector_try_decode_qr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
-	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+// the barcodes have no finder patterns, so the lines across the last one are scanned again, on each side of it
+#define TRACKER_BARCODE_LINES (3)
+
+static int is_tracked_barcode(qrean_detector_tracked_symbol_t *symbol)
 {
-	int found = 0;
-	// try all possible pairs!
-	for (int i = 0; i < num_candidates; i++) {
-		for (int j = i + 1; j < num_candidates; j++) {
-			for (int k = j + 1; k < num_candidates; k++) {
-				int idx[] = { i, j, k, i, k, j, j, i, k, j, k, i, k, i, j, k, j, i };
-				for (int l = 0; l < 6; l++) {
-					image_point_t points[] = {
-						candidates[idx[l * 3 + 0]].center,
-						candidates[idx[l * 3 + 1]].center,
-						candidates[idx[l * 3 + 2]].center,
-					};
+	return QREAN_CODE_TYPE_EAN13 <= symbol->type && symbol->type <= QREAN_CODE_TYPE_ITF;
+}
 
-					qrean_t qrean = create_qrean(QREAN_CODE_TYPE_QR);
+// the middle of the scanline
+static image_point_t barcode_center(image_transform_matrix_t h, int width)
+{
+	return image_point_transform(POINT(width / 2.0f, 0), h);
+}
 
-					for (int version = QR_VERSION_1; version <= QR_VERSION_40; version++) {
-						qrean_set_qr_version(&qrean, (qr_version_t)version);
+// the end bars of the both, joined by the dark pixels
+static int is_same_bars(image_bitmap_t *src, image_point_t a0, image_point_t a1, image_point_t b0, image_point_t b1)
+{
+	if (image_point_distance(a0, b1) + image_point_distance(a1, b0) < image_point_distance(a0, b0) + image_point_distance(a1, b1)) {
+		image_point_t t = b0; // scanned in the other direction
+		b0 = b1;
+		b1 = t;
+	}
 
-						qrean_detector_perspective_t warp = create_qrean_detector_perspective(&qrean, src);
-						qrean_detector_perspective_setup_by_qr_finder_pattern_centers(&warp, points, 0);
+	image_point_t from[] = { a0, a1 }, to[] = { b0, b1 };
+	for (int i = 0; i < 2; i++) {
+		int steps = (int)ceilf(image_point_distance(from[i], to[i]));
+		for (int j = 1; j < steps; j++) {
+			float t = (float)j / steps;
+			image_point_t p = POINT(POINT_X(from[i]) + (POINT_X(to[i]) - POINT_X(from[i])) * t,
+				POINT_Y(from[i]) + (POINT_Y(to[i]) - POINT_Y(from[i])) * t);
+			if (!read_dark_pixel(src, p)) return 0;
+		}
+	}
+	return 1;
+}
 
-						if (qrean_read_qr_finder_pattern(&qrean, -1) > 10) continue;
+// the same type on the scanlines close by, or on the same bars further along them
+static int is_same_barcode(image_bitmap_t *src, qrean_detector_tracked_symbol_t *symbol, qrean_detector_perspective_t *warp)
+{
+	if (!is_tracked_barcode(symbol) || symbol->type != warp->qrean->code->type) return 0;
+
+	image_point_t left = image_point_transform(POINT(0, 0), symbol->h);
+	image_point_t right = image_point_transform(POINT(symbol->width - 1, 0), symbol->h);
+	float size = image_point_distance(left, right);
+	if (size <= 0) return 0;
+
+	image_point_t center = barcode_center(symbol->h, symbol->width);
+	image_point_t found = barcode_center(warp->h, warp->qrean->canvas.symbol_width);
+	float ux = (POINT_X(right) - POINT_X(left)) / size, uy = (POINT_Y(right) - POINT_Y(left)) / size;
+	float dx = POINT_X(found) - POINT_X(center), dy = POINT_Y(found) - POINT_Y(center);
+
+	float along = fabsf(dx * ux + dy * uy);
+	float across = fabsf(dx * uy - dy * ux);
+	if (along > size / 2) return 0;
+	if (across <= (TRACKER_BARCODE_LINES + 1) * BARCODE_LINE_STEP) return 1;
+
+	// a symbol stacked on the other is apart by its quiet zone
+	image_point_t found_left = image_point_transform(POINT(0, 0), warp->h);
+	image_point_t found_right = image_point_transform(POINT(warp->qrean->canvas.symbol_width - 1, 0), warp->h);
+	return is_same_bars(src, left, right, found_left, found_right);
+}
 
-						qrean_detector_perspective_fit_for_qr(&warp);
+typedef struct {
+	qrean_detector_tracker_t *tracker;
+	image_bitmap_t *src;
+	int *tracked; // on this frame, for each of the symbols
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque);
+	void *opaque;
+} tracked_barcode_t;
+
+// the bars are read once for all the decoders, so the ones tracked as the other types (EAN-13 and UPC-A) are taken too
+// the other symbols on the lines are left to the full detection
+static void track_barcode_on_found(qrean_detector_perspective_t *warp, void *opaque)
+{
+	tracked_barcode_t *ctx = (tracked_barcode_t *)opaque;
+	qrean_detector_tracker_t *tracker = ctx->tracker;
 
-						if (qrean_set_qr_format_info(&qrean, qrean_read_qr_format_info(&qrean, -1))) {
-							if (qrean_read_qr_version(&qrean) != version) continue;
+	for (int i = 0; i < tracker->num_symbols; i++) {
+		if (ctx->tracked[i] || !is_same_barcode(ctx->src, &tracker->symbols[i], warp)) continue;
 
-							if (qrean_fix_errors(&qrean) >= 0) {
-								qrean_debug_printf("Detected as QR version: %s\n", qrspec_get_version_string(qrean.qr.version));
-								on_found(&warp, opaque);
-								found++;
-								break;
-							}
-						}
-					}
+		track_symbol_update(&tracker->symbols[i], warp, 0);
+		ctx->tracked[i] = 1;
+		ctx->on_found(warp, ctx->opaque);
+		return;
+	}
+}
 
-					qrean_destroy(&qrean);
-				}
-			}
+// scans the lines across the barcode `n` on the last frame, from its center to the both sides
+static int track_barcode(qrean_detector_tracker_t *tracker, int n, int *tracked, image_bitmap_t *src,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+{
+	qrean_detector_t *detector = tracker->detector;
+	qrean_detector_tracked_symbol_t *symbol = &tracker->symbols[n];
+	tracked_barcode_t ctx = { tracker, src, tracked, on_found, opaque };
+
+	image_point_t center = barcode_center(symbol->h, symbol->width);
+	int horizontal = fabsf(symbol->h.m[0]) >= fabsf(symbol->h.m[3]);
+
+	for (int i = 0; i <= TRACKER_BARCODE_LINES * 2 && !tracked[n]; i++) {
+		int offset = (i % 2 ? 1 : -1) * (i + 1) / 2 * BARCODE_LINE_STEP; // 0, +1, -1, +2, ...
+		int x = POINT_X(center) + offset, y = POINT_Y(center) + offset;
+
+		barcode_runs_t runs;
+		if (horizontal) {
+			if (y < 0 || (int)src->height <= y) continue;
+			runs = create_barcode_runs(src, 0, y, 1, 0);
+		} else {
+			if (x < 0 || (int)src->width <= x) continue;
+			runs = create_barcode_runs(src, x, 0, 0, 1);
 		}
+		scan_barcode_runs(detector, src, &runs, track_barcode_on_found, &ctx);
 	}
 
-	return found;
+	if (tracked[n]) detector_debug_printf(detector, "Tracked %s\n", qrean_get_code_type_string(symbol->type));
+	return tracked[n];
 }
 
-int qrean_detector_try_decode_tqr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
-	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+typedef struct {
+	qrean_detector_tracker_t *tracker;
+	image_bitmap_t *src;
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque);
+	void *opaque;
+} tracker_found_t;
+
+// keeps the symbols found by the full detection, before they are handed to the caller
+static void tracker_on_found(qrean_detector_perspective_t *warp, void *opaque)
 {
-	int found = 0;
-	// try all possible pairs!
-	for (int i = 0; i < num_candidates; i++) {
-		for (int j = i + 1; j < num_candidates; j++) {
-			for (int k = j + 1; k < num_candidates; k++) {
-				int idx[] = { i, j, k, i, k, j, j, i, k, j, k, i, k, i, j, k, j, i };
-				for (int l = 0; l < 6; l++) {
-					image_point_t points[] = {
-						candidates[idx[l * 3 + 0]].center,
-						candidates[idx[l * 3 + 1]].center,
-						candidates[idx[l * 3 + 2]].center,
-					};
-
-					qrean_t qrean = create_qrean(QREAN_CODE_TYPE_TQR);
-					qrean_set_qr_version(&qrean, QR_VERSION_TQR);
-					qrean_set_qr_maskpattern(&qrean, QR_MASKPATTERN_0);
-
-					qrean_detector_perspective_t warp = create_qrean_detector_perspective(&qrean, src);
-					qrean_detector_perspective_setup_by_qr_finder_pattern_centers(&warp, points, 2);
-
-					if (qrean_read_qr_finder_pattern(&qrean, -1) <= 10) {
-						// qrean_detector_perspective_fit_for_qr(&warp);
-						qrean_debug_printf("Detected as tQR\n");
-
-						if (qrean_fix_errors(&qrean) >= 0) {
-							on_found(&warp, opaque);
-							found++;
-						}
-					}
-
-					qrean_destroy(&qrean);
-				}
-			}
-		}
+	tracker_found_t *ctx = (tracker_found_t *)opaque;
+	qrean_detector_tracker_t *tracker = ctx->tracker;
+
+	// the tracked barcodes are found again, as their bars are not skipped like the finder patterns
+	for (int i = 0; i < tracker->num_symbols; i++) {
+		if (is_same_barcode(ctx->src, &tracker->symbols[i], warp)) return;
 	}
 
-	return found;
+	if (tracker->num_symbols < MAX_TRACKED_SYMBOLS) {
+		track_symbol_update(&tracker->symbols[tracker->num_symbols++], warp, 0);
+	}
+
+	ctx->on_found(warp, ctx->opaque);
 }
 
-static image_point_t find_corner(image_t *img, image_point_t c, image_pixel_t pix, float max_dist, float center_theta, float delta_theta)
+// the candidates on the symbols tracked on this frame
+static void tracker_skip(void *opaque, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates)
 {
-	for (float r = max_dist; r > 0; r -= 0.2) {
-		float theta;
-		for (theta = center_theta - delta_theta; theta <= center_theta + delta_theta; theta += 1 / max_dist) {
-			float x = c.x + r * cos(theta);
-			float y = c.y + r * sin(theta);
-			if (image_read_pixel(img, POINT(x, y)) == pix) {
-				return POINT(x, y);
-			}
-		}
+	qrean_detector_tracker_t *tracker = ((tracker_found_t *)opaque)->tracker;
+	for (int i = 0; i < tracker->num_symbols; i++) {
+		qrean_detector_tracked_symbol_t *symbol = &tracker->symbols[i];
+		use_candidates_in_region(symbol->h, symbol->width, symbol->height, candidates, num_candidates);
 	}
-	return c;
 }
 
-static image_point_t find_rmqr_corner_finder_pattern(
-	qrean_detector_perspective_t *warp, image_point_t a, float angle, float dist, int corner_size)
+int qrean_detector_tracker_detect(qrean_detector_tracker_t *tracker, image_bitmap_t *src,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
 {
-	float modsize = image_point_distance(warp->dst[0], warp->dst[1]) / 7;
+	qrean_detector_t *detector = tracker->detector;
+	if (!scratch_fits(detector, src)) return 0;
+
+	int tracked[MAX_TRACKED_SYMBOLS] = {};
+
+	image_bitmap_clear(&detector->scratch.visited);
+	for (int i = 0; i < tracker->num_symbols; i++) {
+		if (tracked[i]) continue; // on the same bars as the barcode before
+		if (is_tracked_barcode(&tracker->symbols[i])) {
+			track_barcode(tracker, i, tracked, src, on_found, opaque);
+		} else {
+			tracked[i] = track_symbol(tracker, &tracker->symbols[i], src, on_found, opaque);
+		}
+	}
 
-	image_point_t last_p = POINT_INVALID;
+	// the lost ones are dropped
 	int found = 0;
-	float delta = 1 / dist;
+	for (int i = 0; i < tracker->num_symbols; i++) {
+		if (tracked[i]) tracker->symbols[found++] = tracker->symbols[i];
+	}
+	int lost = tracker->num_symbols - found;
+	tracker->num_symbols = found;
 
-	if (delta < 0.01) delta = 0.01; // XXX:
-	for (float theta = angle - M_PI / 32; theta <= angle + M_PI / 32; theta += delta) {
-		runlength_t rl = create_runlength();
-		for (int i = 0; i < dist * 2; i += 1) {
-			image_point_t p = POINT(a.x + i * cos(theta), a.y + i * sin(theta));
-			image_pixel_t pix = image_read_pixel(warp->img, p) == 0 ? 1 : 0;
-			if (runlength_push_value(&rl, pix)) {
-				int ratio = round(runlength_get_count(&rl, 1) / modsize);
-				if (ratio != 0 && ratio != 5 && ratio != 6 && ratio != 7 && ratio != 1 && ratio != 3) {
-					break;
-				}
-			}
+	tracker->frames++;
+	int redetect = tracker->redetect_interval > 0 && tracker->frames >= tracker->redetect_interval;
+	if (tracker->num_symbols > 0 && !lost && !redetect) return found;
 
-			if (runlength_match_ratio(&rl, 1, 1, 1, 1, 1, corner_size, 2, -1) && !pix) {
-				float n = i - runlength_get_count(&rl, 0) - runlength_get_count(&rl, 0) / 2.0;
-				image_point_t p = POINT(a.x + n * cos(theta), a.y + n * sin(theta));
+	// the full detection, for the lost and the new ones
+	detector_debug_printf(detector, "Tracker: full detection, %d tracked, %d lost\n", tracker->num_symbols, lost);
+	tracker->frames = 0;
+	tracker_found_t ctx = { tracker, src, on_found, opaque };
+	found += detect_symbols(detector, src, tracker_skip, tracker_on_found, &ctx);
+
+	return found;
+}
 
-				if (image_read_pixel(warp->img, p) != 0) continue;
+// moves the warp on the window down to the image
+static image_transform_matrix_t translate_transform_matrix(image_transform_matrix_t h, float dy)
+{
+	h.m[3] += dy * h.m[6];
+	h.m[4] += dy * h.m[7];
+	h.m[5] += dy;
+	return h;
+}
 
-				if (found < n) {
-					CREATE_IMAGE_BY_CLONE(work, warp->img);
+#ifndef NO_MALLOC
+static void stream_write_row(void *opaque, int y, const uint8_t *dark)
+{
+	qrean_detector_stream_t *stream = (qrean_detector_stream_t *)opaque;
+	size_t stride = IMAGE_BITMAP_STRIDE(stream->width);
+	image_bitmap_t row = create_image_bitmap(stream->width, 2, stream->rows + (y % stream->window) * stride);
+
+	// the row at the both halves
+	image_bitmap_write_dark_row(&row, 0, dark);
+	memcpy(row.buffer + stream->window * stride, row.buffer, stride * sizeof(image_bitmap_word_t));
+	stream->pushed = y + 1;
+}
+#endif
+
+// the window from `top`, in a row on the buffer
+static image_bitmap_t stream_window(qrean_detector_stream_t *stream, int top)
+{
+	size_t stride = IMAGE_BITMAP_STRIDE(stream->width);
+	return create_image_bitmap(stream->width, stream->window, stream->rows + (top % stream->window) * stride);
+}
 
-					image_paint_result_t painted = image_paint(&work, p, PIXEL(255, 0, 0));
-					image_point_t c = image_extent_center(&painted.extent);
-					float dist = image_point_distance(c, p) * 1.2;
-					p = find_corner(&work, c, PIXEL(255, 0, 0), dist, image_point_angle(c, p), modsize * 1.5 / dist);
+typedef struct {
+	qrean_detector_stream_t *stream;
+	int top;
+} stream_found_t;
 
-					DESTROY_IMAGE(work);
+// the candidates on the symbols found on the previous windows
+static void stream_skip(void *opaque, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates)
+{
+	stream_found_t *ctx = (stream_found_t *)opaque;
+	qrean_detector_stream_t *stream = ctx->stream;
+	for (int i = 0; i < stream->num_symbols; i++) {
+		qrean_detector_stream_symbol_t *symbol = &stream->symbols[i];
+		image_transform_matrix_t h = translate_transform_matrix(symbol->h, -ctx->top);
+		use_candidates_in_region(h, symbol->width, symbol->height, candidates, num_candidates);
+	}
+}
 
-					found = n;
-					last_p = p;
-				}
-			}
-		}
+// the one overlapping the other, as two symbols can't overlap on the image
+static int is_same_stream_symbol(qrean_detector_stream_symbol_t *a, qrean_detector_stream_symbol_t *b)
+{
+	if (a->type != b->type) return 0;
+
+	if (QREAN_CODE_TYPE_EAN13 <= a->type && a->type <= QREAN_CODE_TYPE_ITF) {
+		// found on another scanline across the same bars, which go on below as long as it's wide at most
+		image_point_t left = image_point_transform(POINT(0, 0), a->h);
+		image_point_t right = image_point_transform(POINT(a->width, 0), a->h);
+		float size = image_point_distance(left, right);
+		if (size <= 0) return 0;
+
+		float ux = (POINT_X(right) - POINT_X(left)) / size, uy = (POINT_Y(right) - POINT_Y(left)) / size;
+		float dx = POINT_X(b->center) - POINT_X(a->center), dy = POINT_Y(b->center) - POINT_Y(a->center);
+		return fabsf(dx * ux + dy * uy) <= size / 2 && fabsf(dx * uy - dy * ux) <= size;
 	}
 
-	return last_p;
+	return is_inside_region(a->h, a->width, a->height, b->center) || is_inside_region(b->h, b->width, b->height, a->center);
 }
 
-int qrean_detector_perspective_fit_for_rmqr(qrean_detector_perspective_t *warp)
+// the symbols on the overlap of the windows are found twice, so the one of the same type on the same place is dropped
+// the position tells them apart without reading the payload again
+static void stream_on_found(qrean_detector_perspective_t *warp, void *opaque)
 {
-	image_point_t a = image_point_transform(POINT(0, 0), warp->h);
-	image_point_t b = image_point_transform(POINT(warp->qrean->canvas.symbol_width - 1, 0), warp->h);
-	image_point_t c = image_point_transform(POINT(warp->qrean->canvas.symbol_width - 1, warp->qrean->canvas.symbol_height - 1), warp->h);
-	image_point_t d = image_point_transform(POINT(0, warp->qrean->canvas.symbol_height - 1), warp->h);
-	float modsize = image_point_distance(warp->dst[0], warp->dst[1]) / 7;
-	float delta = 0.5 / modsize;
+	stream_found_t *ctx = (stream_found_t *)opaque;
+	qrean_detector_stream_t *stream = ctx->stream;
+	qrean_t *qrean = warp->qrean;
+
+	qrean_detector_perspective_t moved = *warp;
+	moved.h = translate_transform_matrix(warp->h, ctx->top);
+	for (int i = 0; i < 4; i++) moved.dst[i] = POINT(POINT_X(warp->dst[i]), POINT_Y(warp->dst[i]) + ctx->top);
+
+	int w = qrean->canvas.symbol_width, h = qrean->canvas.symbol_height;
+	image_point_t lt = image_point_transform(POINT(-0.5f, -0.5f), moved.h);
+	image_point_t rb = image_point_transform(POINT(w - 0.5f, h - 0.5f), moved.h);
+	qrean_detector_stream_symbol_t symbol = {
+		.type = qrean->code->type,
+		.h = moved.h,
+		.width = w,
+		.height = h,
+		.center = POINT((POINT_X(lt) + POINT_X(rb)) / 2, (POINT_Y(lt) + POINT_Y(rb)) / 2),
+		.size = image_point_distance(lt, rb),
+		.bottom = fmaxf(POINT_Y(lt), POINT_Y(rb)),
+	};
+	// the bars of a barcode go on below the scanline, as long as it's wide at most
+	if (QREAN_IS_TYPE_BARCODE(qrean)) symbol.bottom = POINT_Y(symbol.center) + symbol.size;
 
-	image_point_t rt = find_rmqr_corner_finder_pattern(warp, a, image_point_angle(a, b), image_point_distance(a, b), 3);
-	image_point_t lb = find_rmqr_corner_finder_pattern(warp, a, image_point_angle(a, d), image_point_distance(a, d), 3);
-	if (POINT_IS_INVALID(lb)) {
-		image_point_t center = image_point_transform(POINT(3.5, 3.5), warp->h);
-		float dist = image_point_distance(center, d) * 1.2;
-		lb = find_corner(warp->img, center, PIXEL(0, 0, 0), dist, image_point_angle(center, d), modsize * 1.5 / dist);
+	for (int i = 0; i < stream->num_symbols; i++) {
+		if (is_same_stream_symbol(&stream->symbols[i], &symbol)) return;
 	}
-	image_point_t rb = find_rmqr_corner_finder_pattern(warp, lb, image_point_angle(d, c), image_point_distance(d, c), 5);
-	image_point_t lt;
-	{
-		image_point_t center = image_point_transform(POINT(3.5, 3.5), warp->h);
-		float dist = image_point_distance(center, a) * 1.2;
-		lt = find_corner(warp->img, center, PIXEL(0, 0, 0), dist, image_point_angle(center, a), modsize * 1.5 / dist);
-	}
-
-	qrean_detector_perspective_t backup = *warp;
 
-	if (!POINT_IS_INVALID(lt)) {
-		warp->src[0] = POINT(-0.5 + delta, -0.5 + delta);
-		warp->dst[0] = lt;
+	// the oldest one is dropped, if full
+	if (stream->num_symbols == MAX_STREAM_SYMBOLS) {
+		memmove(stream->symbols, stream->symbols + 1, sizeof(qrean_detector_stream_symbol_t) * --stream->num_symbols);
 	}
+	stream->symbols[stream->num_symbols++] = symbol;
+	stream->found++;
 
-	warp->src[1] = POINT(warp->qrean->canvas.symbol_width - 0.5 - delta, -0.5 + delta);
-	warp->dst[1] = rt;
+	stream->on_found(&moved, stream->opaque);
+}
 
-	warp->src[2] = POINT(warp->qrean->canvas.symbol_width - 0.5 - delta, warp->qrean->canvas.symbol_height - 0.5 - delta);
-	warp->dst[2] = rb;
+static void stream_detect(qrean_detector_stream_t *stream)
+{
+	int top = stream->pushed > (int)stream->window ? stream->pushed - (int)stream->window : 0;
 
-	if (lb.x != d.x || lb.y != d.y) {
-		warp->src[3] = POINT(-0.5 + delta, warp->qrean->canvas.symbol_height - 0.5 - delta);
-		warp->dst[3] = lb;
+	// the symbols above the window can't be found again
+	int n = 0;
+	for (int i = 0; i < stream->num_symbols; i++) {
+		if (stream->symbols[i].bottom >= top) stream->symbols[n++] = stream->symbols[i];
 	}
-	warp->h = create_image_transform_matrix(warp->src, warp->dst);
+	stream->num_symbols = n;
 
-	int score = qrean_read_qr_corner_finder_pattern(warp->qrean, -1);
-	if (score < 10) return 1;
-
-	// restore if it doesn't fit
-	*warp = backup;
-	return 0;
+	detector_debug_printf(stream->detector, "Stream: rows %d to %d\n", top, top + (int)stream->window);
+	image_bitmap_t window = stream_window(stream, top);
+	stream_found_t ctx = { stream, top };
+	detect_symbols(stream->detector, &window, stream_skip, stream_on_found, &ctx);
+	stream->scanned = stream->pushed;
 }
 
-int qrean_detector_try_decode_rmqr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+qrean_detector_stream_t *new_qrean_detector_stream(size_t width, size_t window, float gamma_value,
 	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
 {
-	int found = 0;
-	for (int i = 0; i < num_candidates; i++) {
-		for (int c = 0; c < 4; c++) {
-			qrean_t qrean = create_qrean(QREAN_CODE_TYPE_RMQR);
-			qrean_set_qr_version(&qrean, QR_VERSION_R17x139); // max size
+#ifndef NO_MALLOC
+	qrean_detector_stream_t *stream = (qrean_detector_stream_t *)calloc(1, sizeof(qrean_detector_stream_t));
+	if (!stream) return NULL;
+
+	stream->width = width;
+	stream->window = window;
+	stream->on_found = on_found;
+	stream->opaque = opaque;
+
+	int window_size = width / 8;
+	if (window_size < 3) window_size = 3;
+
+	stream->rows = (image_bitmap_word_t *)calloc(window * 2 * IMAGE_BITMAP_STRIDE(width), sizeof(image_bitmap_word_t));
+	stream->detector = new_qrean_detector(width, window);
+	stream->digitizer = new_image_digitizer(width, window_size, gamma_value, IMAGE_DIGITIZE_ADAPTIVE_BIAS, stream_write_row, stream);
+	if (!stream->rows || !stream->detector || !stream->digitizer) {
+		qrean_detector_stream_free(stream);
+		return NULL;
+	}
 
-			qrean_detector_perspective_t warp = create_qrean_detector_perspective(&qrean, src);
-			qrean_detector_perspective_setup_by_qr_finder_pattern_ring_corners(&warp, candidates[i].corners, c);
+	return stream;
+#else
+	return NULL;
+#endif
+}
 
-			if (qrean_set_qr_format_info(&qrean, qrean_read_qr_format_info(&qrean, -1))) {
-				qrean_debug_printf("Detected as rMQR version: %s\n", qrspec_get_version_string(qrean.qr.version));
+void qrean_detector_stream_free(qrean_detector_stream_t *stream)
+{
+#ifndef NO_MALLOC
+	if (!stream) return;
+	image_digitizer_free(stream->digitizer);
+	qrean_detector_free(stream->detector);
+	free(stream->rows);
+	free(stream);
+#endif
+}
 
-				qrean_detector_perspective_fit_for_rmqr(&warp);
+int qrean_detector_stream_push_rows(qrean_detector_stream_t *stream, image_view_t *rows)
+{
+	int found = stream->found;
+	if (rows->width != stream->width) return 0;
 
-				if (qrean_fix_errors(&qrean) >= 0) {
-					on_found(&warp, opaque);
-					found++;
-				}
-			}
+	for (size_t y = 0; y < rows->height; y++) {
+		image_digitizer_push_row(stream->digitizer, rows, y);
 
-			qrean_destroy(&qrean);
-		}
+		// the windows overlap by the half, so any symbol up to the half is in one of them as a whole
+		if (stream->pushed - stream->scanned >= (int)stream->window / 2) stream_detect(stream);
 	}
 
-	return found;
+	return stream->found - found;
 }
 
-int qrean_detector_try_decode_mqr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
-	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque)
+int qrean_detector_stream_finish(qrean_detector_stream_t *stream)
 {
-	int found = 0;
-	for (int i = 0; i < num_candidates; i++) {
-		for (int c = 0; c < 4; c++) {
-			qrean_t qrean = create_qrean(QREAN_CODE_TYPE_MQR);
-			qrean_set_qr_version(&qrean, QR_VERSION_M4); // max size
-
-			qrean_detector_perspective_t warp = create_qrean_detector_perspective(&qrean, src);
-			qrean_detector_perspective_setup_by_qr_finder_pattern_ring_corners(&warp, candidates[i].corners, c);
+	int found = stream->found;
 
-			if (qrean_set_qr_format_info(&qrean, qrean_read_qr_format_info(&qrean, -1))) {
-				qrean_debug_printf("Detected as mQR version: %s\n", qrspec_get_version_string(qrean.qr.version));
+	image_digitizer_finish(stream->digitizer);
+	if (stream->pushed > stream->scanned) stream_detect(stream);
 
-				if (qrean_read_qr_timing_pattern(&qrean, -1) <= 10) {
-					if (qrean_fix_errors(&qrean) >= 0) {
-						on_found(&warp, opaque);
-						found++;
-					}
-				}
-			}
-
-			qrean_destroy(&qrean);
-		}
-	}
-
-	return found;
+	return stream->found - found;
 }
@@ -1,10 +1,21 @@
 #ifndef __QREAN_DETECTOR_H__
 #define __QREAN_DETECTOR_H__
 
+#include <stdarg.h>
+
 #include "image.h"
 #include "qrean.h"
 
-#define MAX_CANDIDATES (30)
+#define MAX_CANDIDATES          (30) // if the candidates can't grow, without malloc
+#define MAX_CANDIDATE_NEIGHBORS (10) // the nearest ones kept for a candidate
+#define MAX_BARCODE_EDGES       (1024) // if the edges on a barcode scanline can't grow, without malloc
+
+// what the finder pattern candidate looks like, to route it to the decoders
+// unclassified candidates are tried by all of them
+#define QREAN_DETECTOR_CANDIDATE_TRIPLE (1 << 0) // a corner of a triple, for QR and tQR
+#define QREAN_DETECTOR_CANDIDATE_MQR    (1 << 1) // with the timing patterns on the both sides
+#define QREAN_DETECTOR_CANDIDATE_RMQR   (1 << 2) // with the long timing pattern
+#define QREAN_DETECTOR_CANDIDATE_USED   (1 << 3) // consumed by a decoded symbol
 
 typedef struct {
 	image_point_t center;
@@ -13,27 +24,146 @@ typedef struct {
 	image_point_t corners[4];
 
 	int area;
+	int kind; // QREAN_DETECTOR_CANDIDATE_*
+
+	// the ring corner offsets to set up the warp with, if classified
+	int mqr_offset;
+	int rmqr_offset;
+
+	// the nearest candidates of the similar module size, to form the triples with, nearest first
+	// up to MAX_CANDIDATE_NEIGHBORS are kept, the others of a triple are missed if more of them are nearer,
+	// e.g. a large symbol among the small ones; in a grid of the same symbols, they are among the 4 nearest
+	// -1 if not grouped yet
+	int neighbors[MAX_CANDIDATE_NEIGHBORS];
+	int num_neighbors;
 } qrean_detector_qr_finder_candidate_t;
 
+// the corner, and the two of its neighbors
+typedef struct {
+	int i;
+	int a, b;
+} qrean_detector_finder_triple_iterator_t;
+
 typedef struct {
 	uint_fast16_t code;
 	image_point_t s;
 	float barsize;
 } qrean_detector_barcode_candidate_t;
 
+// runs and components of the connected component labeling
+typedef struct {
+	int x1;
+	int x2;
+	int label;
+} qrean_detector_labeling_run_t;
+
+typedef struct {
+	int parent;
+	int enclosing; // the component around, -1 if unknown
+	bit_t dark;
+
+	int area;
+	int64_t sum_x;
+	int64_t sum_y;
+	int left;
+	int top;
+	int right;
+	int bottom;
+} qrean_detector_labeling_component_t;
+
+// work buffers of the detector, to be reused for the frames of the same size
+// the scans fail if the size doesn't match the image
+typedef struct {
+	size_t width;
+	size_t height;
+
+	image_bitmap_t visited; // visit marks of the scans
+	image_bitmap_t painted; // painted temporarily, always cleared after use
+	image_paint_stack_t stack;
+
+	// growing if needed, and kept for the next frame
+	qrean_detector_labeling_run_t *runs;
+	size_t max_runs;
+	qrean_detector_labeling_component_t *components;
+	size_t max_components;
+	size_t *rows;
+	qrean_detector_qr_finder_candidate_t *candidates;
+	size_t max_candidates;
+	int *grid; // spatial grid of the candidates
+	size_t max_grid;
+	image_bitmap_word_t *pyramid; // the downscaled image
+	size_t max_pyramid;
+	int *edges; // of the runs on a barcode scanline
+	size_t max_edges;
+} qrean_detector_scratch_t;
+
+qrean_detector_scratch_t create_qrean_detector_scratch(size_t width, size_t height, void *visited_buffer, void *painted_buffer);
+void qrean_detector_scratch_deinit(qrean_detector_scratch_t *scratch);
+
+// the level is lowered so that the finder patterns are still 6 pixels or more per module
+#define QREAN_DETECTOR_PYRAMID_AUTO      (-1) // by the size of the finder patterns
+#define QREAN_DETECTOR_PYRAMID_MAX_LEVEL (3)
+
+// detector context, which owns all the mutable states of a detection
+// use one per thread, and they can run at once
+typedef struct {
+	qrean_detector_scratch_t scratch;
+	qrean_detector_qr_finder_candidate_t candidates[MAX_CANDIDATES + 1]; // used if the ones on the scratch can't grow
+	int edges[MAX_BARCODE_EDGES]; // same as above, and the rest of a longer scanline is not scanned
+
+	// options
+	int use_labeling; // scan the finder patterns by connected component labeling
+	int pyramid_level; // scan the finder patterns on the image downscaled by 2^n at most, and refine them at the full resolution
+	int scan_barcodes;
+
+	// falls back to the global one, if not set
+	int (*debug_vprintf)(void *opaque, const char *fmt, va_list ap);
+	void *debug_opaque;
+} qrean_detector_t;
+
+qrean_detector_t create_qrean_detector(size_t width, size_t height, void *visited_buffer, void *painted_buffer);
+void qrean_detector_deinit(qrean_detector_t *detector);
+
+// malloc version
+qrean_detector_t *new_qrean_detector(size_t width, size_t height);
+void qrean_detector_free(qrean_detector_t *detector);
+
+void qrean_detector_on_debug_vprintf(
+	qrean_detector_t *detector, int (*vprintf_like)(void *opaque, const char *fmt, va_list ap), void *opaque);
+
+// gives the buffer for the labeling without malloc, as it can't grow, and does nothing with malloc
+// the rows of the image take (height + 1) * sizeof(size_t) of it, and the rest are for the runs and the components
+// the labeling falls back to the run-length scan if it runs out
+void qrean_detector_set_labeling_buffer(qrean_detector_t *detector, void *buffer, size_t size);
+
+#define CREATE_QREAN_DETECTOR(name, width, height) \
+	CREATE_IMAGE_BITMAP(_##name##__visited, width, height); \
+	CREATE_IMAGE_BITMAP(_##name##__painted, width, height); \
+	qrean_detector_t name = create_qrean_detector(width, height, _##name##__visited.buffer, _##name##__painted.buffer);
+
+#define DESTROY_QREAN_DETECTOR(name) \
+	qrean_detector_deinit(&name); \
+	DESTROY_IMAGE_BITMAP(_##name##__painted); \
+	DESTROY_IMAGE_BITMAP(_##name##__visited);
+
 typedef struct {
 	qrean_t *qrean;
-	image_t *img;
+	image_bitmap_t *img;
+	qrean_detector_t *detector;
 
 	image_point_t src[4];
 	image_point_t dst[4];
 	image_transform_matrix_t h;
 } qrean_detector_perspective_t;
 
-int qrean_detector_scan_barcodes(image_t *src, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
-qrean_detector_qr_finder_candidate_t *qrean_detector_scan_qr_finder_pattern(image_t *src, int *num_founds);
+int qrean_detector_scan_barcodes_bitmap(
+	qrean_detector_t *detector, image_bitmap_t *src, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+qrean_detector_qr_finder_candidate_t *qrean_detector_scan_qr_finder_pattern_bitmap(
+	qrean_detector_t *detector, image_bitmap_t *src, int *num_founds);
+qrean_detector_qr_finder_candidate_t *qrean_detector_scan_qr_finder_pattern_by_labeling(
+	qrean_detector_t *detector, image_bitmap_t *src, int *num_founds);
 
-qrean_detector_perspective_t create_qrean_detector_perspective(qrean_t *qrean, image_t *img);
+qrean_detector_perspective_t create_qrean_detector_perspective(qrean_detector_t *detector, qrean_t *qrean, image_bitmap_t *img);
 
 bit_t qrean_detector_perspective_read_image_pixel(qrean_t *qrean, bitpos_t x, bitpos_t y, bitpos_t pos, void *opaque);
 
@@ -45,6 +175,35 @@ void qrean_detector_perspective_setup_by_qr_finder_pattern_ring_corners(
 int qrean_detector_perspective_fit_for_qr(qrean_detector_perspective_t *warp);
 int qrean_detector_perspective_fit_for_rmqr(qrean_detector_perspective_t *warp);
 
+// samples the whole symbol once into the canvas buffer, and detaches the warp from the qrean
+void qrean_detector_perspective_sample(qrean_detector_perspective_t *warp);
+
+// looks at the neighborhood of the candidates once, to route them only to the matching decoders
+void qrean_detector_classify_candidates(
+	qrean_detector_t *detector, image_bitmap_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates);
+
+int qrean_detector_try_decode_qr_bitmap(qrean_detector_t *detector, image_bitmap_t *src,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+int qrean_detector_try_decode_mqr_bitmap(qrean_detector_t *detector, image_bitmap_t *src,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+int qrean_detector_try_decode_rmqr_bitmap(qrean_detector_t *detector, image_bitmap_t *src,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+int qrean_detector_try_decode_tqr_bitmap(qrean_detector_t *detector, image_bitmap_t *src,
+	qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+
+// all of the above, as configured by the options
+int qrean_detector_detect(
+	qrean_detector_t *detector, image_bitmap_t *src, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+
+// the above on the digitized image, kept for the compatibility
+// each call builds a detector and packs the image into a bitmap, the candidates found are kept in the static buffer
+int qrean_detector_scan_barcodes(image_t *src, void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+qrean_detector_qr_finder_candidate_t *qrean_detector_scan_qr_finder_pattern(image_t *src, int *num_founds);
+
 int qrean_detector_try_decode_qr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
 	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
 int qrean_detector_try_decode_mqr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
@@ -54,4 +213,130 @@ int qrean_detector_try_decode_rmqr(image_t *src, qrean_detector_qr_finder_candid
 int qrean_detector_try_decode_tqr(image_t *src, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates,
 	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
 
+// the detection above in steps of the bounded works, to be resumed later, e.g. in a UI loop without threads
+// a work is a row of the finder pattern scan, a candidate (or a triple of them) tried by a decoder, or a line of the barcode scan
+// the labeling and the pyramid scan of the finder patterns are done at once
+typedef enum {
+	QREAN_DETECTOR_STEP_SCAN = 0,
+	QREAN_DETECTOR_STEP_CLASSIFY,
+	QREAN_DETECTOR_STEP_QR,
+	QREAN_DETECTOR_STEP_MQR,
+	QREAN_DETECTOR_STEP_RMQR,
+	QREAN_DETECTOR_STEP_TQR,
+	QREAN_DETECTOR_STEP_BARCODES,
+	QREAN_DETECTOR_STEP_DONE,
+} qrean_detector_step_phase_t;
+
+typedef struct {
+	qrean_detector_t *detector; // not to be used for the others until done
+	image_bitmap_t *src; // kept as is until done
+
+	qrean_detector_step_phase_t phase;
+	int pos; // the row, the candidate or the line in the phase
+	qrean_detector_finder_triple_iterator_t it;
+
+	qrean_detector_qr_finder_candidate_t *candidates;
+	int num_candidates;
+	int found;
+
+	void (*skip)(void *opaque, qrean_detector_qr_finder_candidate_t *candidates, int num_candidates);
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque);
+	void *opaque;
+} qrean_detector_step_t;
+
+qrean_detector_step_t create_qrean_detector_step(qrean_detector_t *detector, image_bitmap_t *src,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+
+// does `max_works` works (a little more at the end of a phase), or all if 0
+// the symbols are reported as soon as decoded, returns 1 if there's more to do, or 0 if done
+int qrean_detector_step(qrean_detector_step_t *step, int max_works);
+
+// tracks the symbols over the frames of a video, to decode them again from where they were
+// the QR family is followed by the finder patterns, and the barcodes by scanning a few lines across the last ones
+#define MAX_TRACKED_SYMBOLS                      (8)
+#define QREAN_DETECTOR_TRACKER_REDETECT_INTERVAL (15) // frames
+
+typedef struct {
+	qrean_code_type_t type;
+	qr_version_t version;
+	qr_errorlevel_t level;
+	qr_maskpattern_t mask;
+	int width;
+	int height;
+
+	// the warp on the last frame
+	image_point_t src[4];
+	image_point_t dst[4];
+	image_transform_matrix_t h;
+
+	// the error corrected modules, reused while the sampled ones are the same
+	uint32_t fingerprint; // of the sampled modules, 0 if unknown
+	uint8_t canvas[QREAN_CANVAS_MAX_BUFFER_SIZE];
+} qrean_detector_tracked_symbol_t;
+
+typedef struct {
+	qrean_detector_t *detector;
+
+	qrean_detector_tracked_symbol_t symbols[MAX_TRACKED_SYMBOLS];
+	int num_symbols;
+	int frames; // since the last full detection
+
+	// options
+	int redetect_interval; // the full detection runs every n frames to find the new symbols too, 0 to run it only if lost
+} qrean_detector_tracker_t;
+
+qrean_detector_tracker_t create_qrean_detector_tracker(qrean_detector_t *detector);
+void qrean_detector_tracker_reset(qrean_detector_tracker_t *tracker);
+
+// malloc version
+qrean_detector_tracker_t *new_qrean_detector_tracker(qrean_detector_t *detector);
+void qrean_detector_tracker_free(qrean_detector_tracker_t *tracker);
+
+// decodes the tracked symbols again, and runs the full detection only if lost any of them, or at the interval
+int qrean_detector_tracker_detect(qrean_detector_tracker_t *tracker, image_bitmap_t *src,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+
+// detects the symbols on the rows as they come, keeping only the rows in the window
+// the window runs every half of it, so the symbols up to the half of the window height are found
+#define MAX_STREAM_SYMBOLS (32) // to drop the ones found again on the overlap of the windows
+
+typedef struct {
+	qrean_code_type_t type;
+	image_transform_matrix_t h; // on the image
+	int width;
+	int height;
+
+	image_point_t center;
+	float size; // diagonal
+	float bottom;
+} qrean_detector_stream_symbol_t;
+
+typedef struct {
+	qrean_detector_t *detector; // of the window size, for the options
+	image_digitizer_t *digitizer;
+
+	size_t width;
+	size_t window; // in rows
+	image_bitmap_word_t *rows; // twice as the window, a row is written on the both halves to see any window in a row
+	int pushed; // digitized rows
+	int scanned; // the bottom of the last window
+	int found;
+
+	qrean_detector_stream_symbol_t symbols[MAX_STREAM_SYMBOLS];
+	int num_symbols;
+
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque);
+	void *opaque;
+} qrean_detector_stream_t;
+
+// malloc only
+qrean_detector_stream_t *new_qrean_detector_stream(size_t width, size_t window, float gamma_value,
+	void (*on_found)(qrean_detector_perspective_t *warp, void *opaque), void *opaque);
+void qrean_detector_stream_free(qrean_detector_stream_t *stream);
+
+// digitizes the rows by the local mean, and detects the symbols as the window fills
+// returns the number of the symbols found by them
+int qrean_detector_stream_push_rows(qrean_detector_stream_t *stream, image_view_t *rows);
+int qrean_detector_stream_finish(qrean_detector_stream_t *stream);
+
 #endif /* __QREAN_DETECTOR_H__ */
@@ -4,6 +4,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "debug.h"
 #include "image.h"
@@ -87,6 +92,40 @@ image_t *image_clone(image_t *img)
 #endif
 }
 
+size_t image_format_get_bytes_per_pixel(image_format_t format)
+{
+	switch (format) {
+	case IMAGE_FORMAT_PIXEL:
+		return sizeof(image_pixel_t);
+	case IMAGE_FORMAT_GRAY8:
+	case IMAGE_FORMAT_YUV_Y:
+		return 1;
+	case IMAGE_FORMAT_RGB24:
+		return 3;
+	case IMAGE_FORMAT_RGBA32:
+	case IMAGE_FORMAT_BGRA32:
+		return 4;
+	}
+	return 0;
+}
+
+image_view_t create_image_view(size_t width, size_t height, size_t stride, image_format_t format, const void *buffer)
+{
+	image_view_t view = {
+		.width = width,
+		.height = height,
+		.stride = stride ? stride : width * image_format_get_bytes_per_pixel(format),
+		.format = format,
+		.buffer = buffer,
+	};
+	return view;
+}
+
+image_view_t create_image_view_from_image(image_t *img)
+{
+	return create_image_view(img->width, img->height, 0, IMAGE_FORMAT_PIXEL, img->buffer);
+}
+
 image_point_t create_image_point(float x, float y)
 {
 	image_point_t p = { .x = x, .y = y };
@@ -107,7 +146,7 @@ void image_draw_pixel(image_t *img, image_point_t p, image_pixel_t pixel)
 	int x = RINT(POINT_X(p));
 	int y = RINT(POINT_Y(p));
 	if (x < 0 || y < 0 || x >= (int)img->width || y >= (int)img->height) return;
-	img->buffer[y * img->width + x] = pixel | ~PIXEL_MASK;
+	IMAGE_DRAW_PIXEL(img, x, y, pixel);
 }
 
 image_pixel_t image_read_pixel(image_t *img, image_point_t p)
@@ -115,7 +154,7 @@ image_pixel_t image_read_pixel(image_t *img, image_point_t p)
 	int x = RINT(POINT_X(p));
 	int y = RINT(POINT_Y(p));
 	if (x < 0 || y < 0 || x >= (int)img->width || y >= (int)img->height) return 0;
-	return img->buffer[y * img->width + x] & PIXEL_MASK;
+	return IMAGE_READ_PIXEL(img, x, y);
 }
 
 void image_save_as_ppm(image_t *img, FILE *out)
@@ -269,46 +308,433 @@ void image_extent_dump(image_extent_t *extent)
 	fprintf(stderr, "[%f %f %f %f]\n", extent->top, extent->right, extent->bottom, extent->left);
 }
 
-static void image_paint_update_result(image_paint_result_t *target, image_paint_result_t result)
+// the fill test and the painter, to share the span filling with the bitmap
+typedef struct {
+	size_t width;
+	size_t height;
+	int (*is_paintable)(void *opaque, int x, int y);
+	void (*paint)(void *opaque, int x, int y);
+	void *opaque;
+} image_paint_target_t;
+
+static int image_paint_push(image_paint_stack_t *stack, image_paint_span_t **heap, size_t *sp, image_paint_span_t span)
 {
-	if (result.area) {
-		image_extent_update(&target->extent, result.extent);
-		target->area += result.area;
+	if (*sp >= stack->size) {
+#ifndef NO_MALLOC
+		size_t size = stack->size ? stack->size * 2 : IMAGE_PAINT_DEFAULT_STACK_SIZE;
+		image_paint_span_t *spans;
+
+		if (stack->growable) {
+			spans = (image_paint_span_t *)realloc(stack->spans, size * sizeof(image_paint_span_t));
+			if (!spans) return 0;
+		} else if (heap) {
+			// move the default stack onto the heap
+			spans = (image_paint_span_t *)malloc(size * sizeof(image_paint_span_t));
+			if (!spans) return 0;
+			memcpy(spans, stack->spans, stack->size * sizeof(image_paint_span_t));
+			free(*heap);
+			*heap = spans;
+		} else {
+			return 0;
+		}
+		stack->spans = spans;
+		stack->size = size;
+#else
+		return 0;
+#endif
 	}
+	stack->spans[(*sp)++] = span;
+	return 1;
 }
 
-image_paint_result_t image_paint(image_t *img, image_point_t center, image_pixel_t pix)
+// paints the horizontal run through (x, y), and returns the span
+static image_paint_span_t image_paint_run(image_paint_target_t *t, int x, int y, image_paint_result_t *result)
 {
-	float cx = POINT_X(center);
-	float cy = POINT_Y(center);
+	int lx, rx;
+	for (lx = x; lx > 0 && t->is_paintable(t->opaque, lx - 1, y); lx--)
+		;
+	for (rx = x; rx + 1 < (int)t->width && t->is_paintable(t->opaque, rx + 1, y); rx++)
+		;
+
+	for (int i = lx; i <= rx; i++) {
+		t->paint(t->opaque, i, y);
+	}
+	if (lx < result->extent.left) result->extent.left = lx;
+	if (rx > result->extent.right) result->extent.right = rx;
+	if (y < result->extent.top) result->extent.top = y;
+	if (y > result->extent.bottom) result->extent.bottom = y;
+	result->area += rx - lx + 1;
+
+	image_paint_span_t span = { lx, rx, y };
+	return span;
+}
+
+static image_paint_result_t image_paint_spans(image_paint_target_t *t, image_point_t center, image_paint_stack_t *stack, int max_area)
+{
+	int cx = RINT(POINT_X(center));
+	int cy = RINT(POINT_Y(center));
 	image_paint_result_t result = {
 		{cy, cx, cy, cx},
 		0,
+		0,
 	};
 
-	if (cx < 0 || cy < 0 || cx >= (int)img->width || cy >= (int)img->height) return result;
+	if (cx < 0 || cy < 0 || cx >= (int)t->width || cy >= (int)t->height) return result;
+	if (!t->is_paintable(t->opaque, cx, cy)) return result;
 
-	image_pixel_t bg = image_read_pixel(img, center);
-	if (bg == pix) return result;
+	image_paint_span_t default_spans[IMAGE_PAINT_DEFAULT_STACK_SIZE];
+	image_paint_stack_t default_stack = { default_spans, IMAGE_PAINT_DEFAULT_STACK_SIZE, 0 };
+	image_paint_span_t *heap = NULL;
+	image_paint_span_t **growable = stack ? NULL : &heap;
+	if (!stack) stack = &default_stack;
 
-	int lx, rx;
-	for (lx = cx; lx >= 0 && image_read_pixel(img, POINT(lx, cy)) == bg; lx--) {
-		image_draw_pixel(img, POINT(lx, cy), pix);
-		result.area++;
-		result.extent.left = lx;
+	size_t sp = 0;
+	image_paint_push(stack, growable, &sp, image_paint_run(t, cx, cy, &result));
+
+	while (sp > 0) {
+		image_paint_span_t span = stack->spans[--sp];
+
+		for (int dy = -1; dy <= 1; dy += 2) {
+			int y = span.y + dy;
+			if (y < 0 || y >= (int)t->height) continue;
+
+			// the left side includes the diagonal neighbor, as the recursive version did
+			for (int x = span.lx > 0 ? span.lx - 1 : 0; x <= span.rx; x++) {
+				if (!t->is_paintable(t->opaque, x, y)) continue;
+
+				if (max_area && result.area >= max_area) {
+					result.truncated = 1;
+					goto end;
+				}
+
+				image_paint_span_t next = image_paint_run(t, x, y, &result);
+				if (!image_paint_push(stack, growable, &sp, next)) {
+					// out of stack, the rest of the region is left unpainted
+					result.truncated = 1;
+					goto end;
+				}
+				x = next.rx + 1;
+			}
+		}
 	}
-	for (rx = cx + 1; rx < (int)img->width && image_read_pixel(img, POINT(rx, cy)) == bg; rx++) {
-		image_draw_pixel(img, POINT(rx, cy), pix);
-		result.area++;
-		result.extent.right = rx;
+
+end:
+#ifndef NO_MALLOC
+	free(heap);
+#endif
+
+	return result;
+}
+
+typedef struct {
+	image_t *img;
+	image_pixel_t bg;
+	image_pixel_t pix;
+} image_paint_image_t;
+
+static int image_paint_image_is_paintable(void *opaque, int x, int y)
+{
+	image_paint_image_t *p = (image_paint_image_t *)opaque;
+	return IMAGE_READ_PIXEL(p->img, x, y) == p->bg;
+}
+
+static void image_paint_image_paint(void *opaque, int x, int y)
+{
+	image_paint_image_t *p = (image_paint_image_t *)opaque;
+	IMAGE_DRAW_PIXEL(p->img, x, y, p->pix);
+}
+
+image_paint_result_t image_paint_bounded(image_t *img, image_point_t center, image_pixel_t pix, image_paint_stack_t *stack, int max_area)
+{
+	image_paint_image_t p = { img, image_read_pixel(img, center), pix & PIXEL_MASK };
+	image_paint_target_t t = { img->width, img->height, image_paint_image_is_paintable, image_paint_image_paint, &p };
+
+	if (p.bg == p.pix) {
+		image_paint_result_t result = {
+			{POINT_Y(center), POINT_X(center), POINT_Y(center), POINT_X(center)},
+			0,
+			0,
+		};
+		return result;
 	}
 
-	for (int x = lx; x < rx; x++) {
-		if (image_read_pixel(img, POINT(x, cy - 1)) == bg) image_paint_update_result(&result, image_paint(img, POINT(x, cy - 1), pix));
-		if (image_read_pixel(img, POINT(x, cy + 1)) == bg) image_paint_update_result(&result, image_paint(img, POINT(x, cy + 1), pix));
+	return image_paint_spans(&t, center, stack, max_area);
+}
+
+image_paint_result_t image_paint(image_t *img, image_point_t center, image_pixel_t pix)
+{
+	return image_paint_bounded(img, center, pix, NULL, 0);
+}
+
+void image_bitmap_init(image_bitmap_t *bmp, size_t width, size_t height, void *buffer)
+{
+	bmp->width = width;
+	bmp->height = height;
+	bmp->stride = IMAGE_BITMAP_STRIDE(width);
+	bmp->buffer = buffer;
+}
+
+image_bitmap_word_t *new_image_bitmap_buffer(size_t width, size_t height)
+{
+#ifndef NO_MALLOC
+	return (image_bitmap_word_t *)calloc(IMAGE_BITMAP_STRIDE(width) * height, sizeof(image_bitmap_word_t));
+#else
+	return NULL;
+#endif
+}
+
+void image_bitmap_buffer_free(image_bitmap_word_t *buffer)
+{
+#ifndef NO_MALLOC
+	free(buffer);
+#endif
+}
+
+image_bitmap_t *new_image_bitmap(size_t width, size_t height)
+{
+#ifndef NO_MALLOC
+	image_bitmap_t *bmp = (image_bitmap_t *)malloc(sizeof(image_bitmap_t));
+	if (!bmp) return NULL;
+
+	void *buffer = new_image_bitmap_buffer(width, height);
+	if (!buffer) {
+		free(bmp);
+		return NULL;
 	}
+	image_bitmap_init(bmp, width, height, buffer);
 
-	return result;
+	return bmp;
+#else
+	return NULL;
+#endif
+}
+
+void image_bitmap_free(image_bitmap_t *bmp)
+{
+#ifndef NO_MALLOC
+	image_bitmap_buffer_free(bmp->buffer);
+	free(bmp);
+#endif
+}
+
+image_bitmap_t create_image_bitmap(size_t width, size_t height, void *buffer)
+{
+	image_bitmap_t bmp = {};
+	image_bitmap_init(&bmp, width, height, buffer);
+	return bmp;
+}
+
+image_bitmap_t *image_bitmap_copy(image_bitmap_t *dst, image_bitmap_t *src)
+{
+	memcpy(dst->buffer, src->buffer, src->stride * src->height * sizeof(image_bitmap_word_t));
+	return dst;
+}
+
+image_bitmap_t *image_bitmap_clone(image_bitmap_t *bmp)
+{
+#ifndef NO_MALLOC
+	image_bitmap_t *clone = new_image_bitmap(bmp->width, bmp->height);
+	if (clone) image_bitmap_copy(clone, bmp);
+	return clone;
+#else
+	return NULL;
+#endif
+}
+
+
+void image_bitmap_clear(image_bitmap_t *bmp)
+{
+	memset(bmp->buffer, 0, bmp->stride * bmp->height * sizeof(image_bitmap_word_t));
+}
+
+void image_bitmap_clear_extent(image_bitmap_t *bmp, image_extent_t extent)
+{
+	if (isnan(extent.left) || isnan(extent.top) || isnan(extent.right) || isnan(extent.bottom)) return;
+
+	int left = extent.left < 0 ? 0 : floor(extent.left);
+	int top = extent.top < 0 ? 0 : floor(extent.top);
+	int right = extent.right >= bmp->width ? (int)bmp->width - 1 : ceil(extent.right);
+	int bottom = extent.bottom >= bmp->height ? (int)bmp->height - 1 : ceil(extent.bottom);
+	if (left > right || top > bottom) return;
+
+	for (int y = top; y <= bottom; y++) {
+		image_bitmap_word_t *line = IMAGE_BITMAP_ROW(bmp, y);
+		for (int i = left / IMAGE_BITMAP_WORD_BITS; i <= right / IMAGE_BITMAP_WORD_BITS; i++) {
+			int s = left > i * IMAGE_BITMAP_WORD_BITS ? left % IMAGE_BITMAP_WORD_BITS : 0;
+			int e = right < (i + 1) * IMAGE_BITMAP_WORD_BITS - 1 ? right % IMAGE_BITMAP_WORD_BITS : IMAGE_BITMAP_WORD_BITS - 1;
+			line[i] &= ~((~(image_bitmap_word_t)0 >> s) & (~(image_bitmap_word_t)0 << (IMAGE_BITMAP_WORD_BITS - 1 - e)));
+		}
+	}
+}
+
+void image_bitmap_draw_pixel(image_bitmap_t *bmp, image_point_t p, bit_t v)
+{
+	int x = RINT(POINT_X(p));
+	int y = RINT(POINT_Y(p));
+	if (x < 0 || y < 0 || x >= (int)bmp->width || y >= (int)bmp->height) return;
+
+	image_bitmap_word_t *word = &IMAGE_BITMAP_ROW(bmp, y)[x / IMAGE_BITMAP_WORD_BITS];
+	if (v) {
+		*word |= IMAGE_BITMAP_BIT(x);
+	} else {
+		*word &= ~IMAGE_BITMAP_BIT(x);
+	}
+}
+
+bit_t image_bitmap_read_pixel(image_bitmap_t *bmp, image_point_t p)
+{
+	int x = RINT(POINT_X(p));
+	int y = RINT(POINT_Y(p));
+	if (x < 0 || y < 0 || x >= (int)bmp->width || y >= (int)bmp->height) return 0;
+	return IMAGE_BITMAP_READ_PIXEL(bmp, x, y);
+}
+
+static inline int image_bitmap_clz(image_bitmap_word_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_clzll(word);
+#else
+	int n = 0;
+	while (!(word & ((image_bitmap_word_t)1 << (IMAGE_BITMAP_WORD_BITS - 1)))) {
+		word <<= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+// returns the first x' > x, where the pixel of `bmp` or `mask` differs from the one at x, or the width
+int image_bitmap_next_edge(image_bitmap_t *bmp, image_bitmap_t *mask, int x, int y)
+{
+	if (x < 0 || y < 0 || x >= (int)bmp->width || y >= (int)bmp->height) return x + 1;
+
+	image_bitmap_word_t *line = IMAGE_BITMAP_ROW(bmp, y);
+	image_bitmap_word_t *mline = mask ? mask->buffer + y * mask->stride : NULL;
+	int i = x / IMAGE_BITMAP_WORD_BITS;
+
+	// all 0s or all 1s, to make the matching bits 0 by XOR
+	image_bitmap_word_t v = (line[i] & IMAGE_BITMAP_BIT(x)) ? ~(image_bitmap_word_t)0 : 0;
+	image_bitmap_word_t m = mline && (mline[i] & IMAGE_BITMAP_BIT(x)) ? ~(image_bitmap_word_t)0 : 0;
+
+	// skip the bits up to x in the first word
+	image_bitmap_word_t skip = (IMAGE_BITMAP_BIT(x) << 1) - 1;
+
+	for (; i < (int)bmp->stride; i++, skip = ~(image_bitmap_word_t)0) {
+		image_bitmap_word_t diff = (line[i] ^ v) | (mline ? mline[i] ^ m : 0);
+		diff &= skip;
+		if (diff) {
+			int nx = i * IMAGE_BITMAP_WORD_BITS + image_bitmap_clz(diff);
+			return nx < (int)bmp->width ? nx : (int)bmp->width;
+		}
+	}
+	return bmp->width;
+}
+
+typedef struct {
+	image_bitmap_t *mask;
+	image_bitmap_t *bmp;
+	bit_t bg;
+	bit_t v;
+} image_paint_bitmap_t;
+
+static int image_paint_bitmap_is_paintable(void *opaque, int x, int y)
+{
+	image_paint_bitmap_t *p = (image_paint_bitmap_t *)opaque;
+	image_bitmap_word_t bit = IMAGE_BITMAP_BIT(x);
+	int i = x / IMAGE_BITMAP_WORD_BITS;
+
+	return !!(p->bmp->buffer[y * p->bmp->stride + i] & bit) == p->bg && !!(p->mask->buffer[y * p->mask->stride + i] & bit) != p->v;
+}
+
+static void image_paint_bitmap_paint(void *opaque, int x, int y)
+{
+	image_paint_bitmap_t *p = (image_paint_bitmap_t *)opaque;
+	image_bitmap_word_t *word = &p->mask->buffer[y * p->mask->stride + x / IMAGE_BITMAP_WORD_BITS];
+
+	if (p->v) {
+		*word |= IMAGE_BITMAP_BIT(x);
+	} else {
+		*word &= ~IMAGE_BITMAP_BIT(x);
+	}
+}
+
+// paints `v` on `mask` over the region of the same color on `bmp`
+image_paint_result_t image_bitmap_paint_bounded(
+	image_bitmap_t *mask, image_bitmap_t *bmp, image_point_t center, bit_t v, image_paint_stack_t *stack, int max_area)
+{
+	image_paint_bitmap_t p = { mask, bmp, image_bitmap_read_pixel(bmp, center), v ? 1 : 0 };
+	image_paint_target_t t = { bmp->width, bmp->height, image_paint_bitmap_is_paintable, image_paint_bitmap_paint, &p };
+
+	return image_paint_spans(&t, center, stack, max_area);
+}
+
+image_paint_result_t image_bitmap_paint(image_bitmap_t *mask, image_bitmap_t *bmp, image_point_t center, bit_t v)
+{
+	return image_bitmap_paint_bounded(mask, bmp, center, v, NULL, 0);
+}
+
+// the 8 neighbors in the clockwise order, from the east
+static const int image_trace_dx[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int image_trace_dy[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+
+static int image_trace_direction(int dx, int dy)
+{
+	for (int d = 0; d < 8; d++) {
+		if (image_trace_dx[d] == dx && image_trace_dy[d] == dy) return d;
+	}
+	return 0;
+}
+
+static int image_trace_is_set(image_bitmap_t *mask, int x, int y)
+{
+	if (x < 0 || y < 0 || x >= (int)mask->width || y >= (int)mask->height) return 0;
+	return IMAGE_BITMAP_READ_PIXEL(mask, x, y);
+}
+
+// traces the outer boundary of the 8-connected region set in `mask`, clockwise, by Moore-neighbor tracing
+// (x, y) must be the top-left most pixel of the region, and `on_point` is called for each boundary pixel
+// returns the number of the boundary pixels visited
+int image_bitmap_trace_boundary(image_bitmap_t *mask, int x, int y, void (*on_point)(void *opaque, int x, int y), void *opaque)
+{
+	if (!image_trace_is_set(mask, x, y)) return 0;
+
+	int sx = x, sy = y;
+	int back = 4; // the west of the top-left most pixel is always outside
+	int first = -1;
+	int steps = 0;
+	size_t max_steps = mask->width * mask->height * 4; // just in case
+
+	while ((size_t)steps < max_steps) {
+		int next = -1;
+		for (int i = 1; i <= 8; i++) {
+			int d = (back + i) % 8;
+			if (image_trace_is_set(mask, x + image_trace_dx[d], y + image_trace_dy[d])) {
+				next = d;
+				break;
+			}
+		}
+		if (next < 0) {
+			// an isolated pixel
+			on_point(opaque, x, y);
+			return 1;
+		}
+
+		// back to the start, going the same way as the first time
+		if (x == sx && y == sy && next == first) break;
+		if (first < 0) first = next;
+
+		on_point(opaque, x, y);
+		steps++;
+
+		// the last neighbor checked before `next` is outside, search from it on the next pixel
+		int bd = (next + 7) % 8;
+		int bx = x + image_trace_dx[bd], by = y + image_trace_dy[bd];
+		x += image_trace_dx[next];
+		y += image_trace_dy[next];
+		back = image_trace_direction(bx - x, by - y);
+	}
+
+	return steps;
 }
 
 float image_point_norm(image_point_t a)
@@ -339,32 +765,155 @@ void image_draw_extent(image_t *img, image_extent_t extent, image_pixel_t pix, i
 	image_draw_polygon(img, 4, points, pix, thickness);
 }
 
+// luma = 0.299 R + 0.587 G + 0.114 B, in 1.15 fixed-point
+#define LUMA_WEIGHT_R (9798)
+#define LUMA_WEIGHT_G (19235)
+#define LUMA_WEIGHT_B (3735)
+#define LUMA_SHIFT    (15)
+#define LUMA(r, g, b) ((LUMA_WEIGHT_R * (r) + LUMA_WEIGHT_G * (g) + LUMA_WEIGHT_B * (b)) >> LUMA_SHIFT)
+
+#if defined(__SSE2__)
+// 4 pixels at once, the weights of R and B are packed in 16bit lanes to feed pmaddwd
+static inline __m128i image_luma_sse2(__m128i pix)
+{
+	const __m128i mask = _mm_set1_epi32(0x00FF00FF);
+	const __m128i w_rb = _mm_set1_epi32(LUMA_WEIGHT_R | (LUMA_WEIGHT_B << 16));
+	const __m128i w_g = _mm_set1_epi32(LUMA_WEIGHT_G);
+
+	__m128i rb = _mm_madd_epi16(_mm_and_si128(pix, mask), w_rb);
+	__m128i g = _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(pix, 8), _mm_set1_epi32(0xFF)), w_g);
+	return _mm_srli_epi32(_mm_add_epi32(rb, g), LUMA_SHIFT);
+}
+#endif
+
+#if defined(__AVX2__)
+// 8 pixels at once
+static inline __m256i image_luma_avx2(__m256i pix)
+{
+	const __m256i mask = _mm256_set1_epi32(0x00FF00FF);
+	const __m256i w_rb = _mm256_set1_epi32(LUMA_WEIGHT_R | (LUMA_WEIGHT_B << 16));
+	const __m256i w_g = _mm256_set1_epi32(LUMA_WEIGHT_G);
+
+	__m256i rb = _mm256_madd_epi16(_mm256_and_si256(pix, mask), w_rb);
+	__m256i g = _mm256_madd_epi16(_mm256_and_si256(_mm256_srli_epi32(pix, 8), _mm256_set1_epi32(0xFF)), w_g);
+	return _mm256_srli_epi32(_mm256_add_epi32(rb, g), LUMA_SHIFT);
+}
+#endif
+
+static void image_luma_row(uint8_t *dst, const image_pixel_t *src, int n)
+{
+	int x = 0;
+
+#if defined(__AVX2__)
+	for (; x + 16 <= n; x += 16) {
+		__m256i a = image_luma_avx2(_mm256_loadu_si256((const __m256i *)(src + x)));
+		__m256i b = image_luma_avx2(_mm256_loadu_si256((const __m256i *)(src + x + 8)));
+		__m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+		__m128i v = _mm_packus_epi16(_mm256_castsi256_si128(ab), _mm256_extracti128_si256(ab, 1));
+		_mm_storeu_si128((__m128i *)(dst + x), v);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; x + 8 <= n; x += 8) {
+		__m128i a = image_luma_sse2(_mm_loadu_si128((const __m128i *)(src + x)));
+		__m128i b = image_luma_sse2(_mm_loadu_si128((const __m128i *)(src + x + 4)));
+		__m128i v = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_setzero_si128());
+		_mm_storel_epi64((__m128i *)(dst + x), v);
+	}
+#endif
+	for (; x < n; x++) {
+		image_pixel_t pix = src[x];
+		dst[x] = LUMA(PIXEL_GET_R(pix), PIXEL_GET_G(pix), PIXEL_GET_B(pix));
+	}
+}
+
+static void image_gamma_table(uint8_t table[256], float gamma_value)
+{
+	for (int i = 0; i < 256; i++) {
+		table[i] = pow(i / 255.0, 1 / gamma_value) * 255;
+	}
+}
+
+static void image_gray_row(uint8_t *dst, image_view_t *src, int y, const uint8_t table[256])
+{
+	const uint8_t *line = (const uint8_t *)src->buffer + y * src->stride;
+	int w = src->width;
+
+	switch (src->format) {
+	case IMAGE_FORMAT_PIXEL:
+		image_luma_row(dst, (const image_pixel_t *)line, w);
+		break;
+
+	case IMAGE_FORMAT_GRAY8:
+	case IMAGE_FORMAT_YUV_Y:
+		memcpy(dst, line, w);
+		break;
+
+	case IMAGE_FORMAT_RGB24:
+		for (int x = 0; x < w; x++) {
+			dst[x] = LUMA(line[x * 3 + 0], line[x * 3 + 1], line[x * 3 + 2]);
+		}
+		break;
+
+	case IMAGE_FORMAT_RGBA32:
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		// same layout as image_pixel_t
+		if (((uintptr_t)line & (sizeof(image_pixel_t) - 1)) == 0) {
+			image_luma_row(dst, (const image_pixel_t *)line, w);
+			break;
+		}
+#endif
+		for (int x = 0; x < w; x++) {
+			dst[x] = LUMA(line[x * 4 + 0], line[x * 4 + 1], line[x * 4 + 2]);
+		}
+		break;
+
+	case IMAGE_FORMAT_BGRA32:
+		for (int x = 0; x < w; x++) {
+			dst[x] = LUMA(line[x * 4 + 2], line[x * 4 + 1], line[x * 4 + 0]);
+		}
+		break;
+	}
+
+	for (int x = 0; x < w; x++) {
+		dst[x] = table[dst[x]];
+	}
+}
+
 void image_monochrome(image_t *dst, image_t *src, float gamma_value, size_t hist_result[256])
 {
 	size_t hist[256] = { 0 };
-	for (int y = 0; y < (int)src->height; y++) {
-		for (int x = 0; x < (int)src->width; x++) {
-			image_pixel_t pix = image_read_pixel(src, POINT(x, y));
+	uint8_t table[256];
+	uint8_t luma[256];
+
+	image_gamma_table(table, gamma_value);
 
-			uint8_t value
-				= pow((0.299 * PIXEL_GET_R(pix) + 0.587 * PIXEL_GET_G(pix) + 0.114 * PIXEL_GET_B(pix)) / 255.0, 1 / gamma_value) * 255;
-			image_draw_pixel(dst, POINT(x, y), PIXEL(value, value, value));
-			hist[value]++;
+	for (int y = 0; y < (int)src->height; y++) {
+		image_pixel_t *s = IMAGE_ROW(src, y);
+		image_pixel_t *d = IMAGE_ROW(dst, y);
+
+		// in chunks, to keep the luma buffer on the stack
+		for (int x = 0; x < (int)src->width; x += sizeof(luma)) {
+			int n = (int)src->width - x < (int)sizeof(luma) ? (int)src->width - x : (int)sizeof(luma);
+
+			image_luma_row(luma, s + x, n);
+			for (int i = 0; i < n; i++) {
+				uint8_t value = table[luma[i]];
+				d[x + i] = PIXEL(value, value, value) | ~PIXEL_MASK;
+				hist[value]++;
+			}
 		}
 	}
 	if (hist_result) memcpy(hist_result, hist, sizeof(hist));
 }
 
-void image_digitize(image_t *dst, image_t *src, float gamma_value)
+static uint8_t image_otsu_threshold(size_t hist[256])
 {
 	// Using otsu method
 	// https://en.wikipedia.org/wiki/Otsu%27s_method
-	size_t hist[256] = { 0 };
 	uint8_t threshold = 0;
 	float max_sigma = 0.0;
 
-	image_monochrome(dst, src, gamma_value, hist);
-
 	for (int t = 0; t < 256; t++) {
 		float w0 = 0.0;
 		float w1 = 0.0;
@@ -394,12 +943,344 @@ void image_digitize(image_t *dst, image_t *src, float gamma_value)
 			threshold = t;
 		}
 	}
+	return threshold;
+}
+
+void image_digitize(image_t *dst, image_t *src, float gamma_value)
+{
+	size_t hist[256] = { 0 };
+
+	image_monochrome(dst, src, gamma_value, hist);
+
+	uint8_t threshold = image_otsu_threshold(hist);
 	qrean_debug_printf("threshold: %d\n", threshold);
 
-	for (int y = 0; y < (int)dst->height; y++) {
-		for (int x = 0; x < (int)dst->width; x++) {
-			image_pixel_t pix = image_read_pixel(dst, POINT(x, y));
-			image_draw_pixel(dst, POINT(x, y), PIXEL_GET_R(pix) < threshold ? PIXEL(0, 0, 0) : PIXEL(255, 255, 255));
+	for (size_t i = 0; i < dst->width * dst->height; i++) {
+		dst->buffer[i] = (PIXEL_GET_R(dst->buffer[i]) < threshold ? PIXEL(0, 0, 0) : PIXEL(255, 255, 255)) | ~PIXEL_MASK;
+	}
+}
+
+static void image_write_dark_row(void *dst, int y, const uint8_t *dark)
+{
+	image_t *img = (image_t *)dst;
+	image_pixel_t *line = IMAGE_ROW(img, y);
+
+	for (int x = 0; x < (int)img->width; x++) {
+		line[x] = (dark[x] ? PIXEL(0, 0, 0) : PIXEL(255, 255, 255)) | ~PIXEL_MASK;
+	}
+}
+
+void image_bitmap_write_dark_row(void *dst, int y, const uint8_t *dark)
+{
+	image_bitmap_t *bmp = (image_bitmap_t *)dst;
+	image_bitmap_word_t *line = IMAGE_BITMAP_ROW(bmp, y);
+
+	for (size_t i = 0; i < bmp->stride; i++) {
+		image_bitmap_word_t word = 0;
+		for (int b = 0; b < IMAGE_BITMAP_WORD_BITS; b++) {
+			size_t x = i * IMAGE_BITMAP_WORD_BITS + b;
+			word = (word << 1) | (x < bmp->width && dark[x] ? 1 : 0);
+		}
+		line[i] = word;
+	}
+}
+
+// Using local mean method with the sums of the columns
+//
+// The sums of the columns over the rows in the window are kept, and the
+// running sum of them along the row gives the sum over the window. Only
+// 2r+1 gray rows are kept in a ring, to take the row leaving the window
+// out of the sums. The rows are kept, so that `dst` can be `src`.
+image_digitizer_t create_image_digitizer(size_t width, int window_size, float gamma_value, int bias, uint32_t *sums, uint8_t *gray,
+	void (*write_row)(void *dst, int y, const uint8_t *dark), void *dst)
+{
+	int r = window_size / 2;
+	image_digitizer_t digitizer = {
+		.width = width,
+		.r = r,
+		.bias = bias < 0 ? 0 : bias > 100 ? 100 : bias,
+		.sums = sums,
+		.gray = gray,
+		.write_row = write_row,
+		.dst = dst,
+	};
+	image_gamma_table(digitizer.table, gamma_value);
+	memset(sums, 0, sizeof(uint32_t) * width);
+
+	return digitizer;
+}
+
+image_digitizer_t *new_image_digitizer(size_t width, int window_size, float gamma_value, int bias,
+	void (*write_row)(void *dst, int y, const uint8_t *dark), void *dst)
+{
+#ifndef NO_MALLOC
+	int r = window_size / 2;
+	image_digitizer_t *digitizer = (image_digitizer_t *)malloc(sizeof(image_digitizer_t));
+	uint32_t *sums = (uint32_t *)malloc(sizeof(uint32_t) * IMAGE_DIGITIZER_SUMS_SIZE(width));
+	uint8_t *gray = (uint8_t *)malloc(IMAGE_DIGITIZER_GRAY_SIZE(width, r));
+	if (!digitizer || !sums || !gray) {
+		free(digitizer);
+		free(sums);
+		free(gray);
+		return NULL;
+	}
+
+	*digitizer = create_image_digitizer(width, window_size, gamma_value, bias, sums, gray, write_row, dst);
+	return digitizer;
+#else
+	return NULL;
+#endif
+}
+
+void image_digitizer_free(image_digitizer_t *digitizer)
+{
+#ifndef NO_MALLOC
+	if (!digitizer) return;
+	free(digitizer->sums);
+	free(digitizer->gray);
+	free(digitizer);
+#endif
+}
+
+// takes the rows above `y` out of the sums
+static void image_digitizer_drop_rows(image_digitizer_t *digitizer, int y)
+{
+	int w = digitizer->width;
+	int gray_rows = 2 * digitizer->r + 1;
+
+	for (; digitizer->dropped < y; digitizer->dropped++) {
+		uint8_t *line = digitizer->gray + (digitizer->dropped % gray_rows) * w;
+		for (int x = 0; x < w; x++) digitizer->sums[x] -= line[x];
+	}
+}
+
+static void image_digitizer_write_row(image_digitizer_t *digitizer, int y)
+{
+	int w = digitizer->width;
+	int r = digitizer->r;
+	int gray_rows = 2 * r + 1;
+
+	image_digitizer_drop_rows(digitizer, y - r);
+
+	// NOTE: unsigned arithmetic wraps around, but the sum over the window never does
+	uint32_t *columns = digitizer->sums;
+	uint32_t *row = digitizer->sums + w;
+	uint8_t *line = digitizer->gray + (y % gray_rows) * w;
+	uint8_t *dark = digitizer->gray + gray_rows * w;
+	int rows = digitizer->pushed - digitizer->dropped;
+
+	row[0] = 0;
+	for (int x = 0; x < w; x++) row[x + 1] = row[x] + columns[x];
+
+	for (int x = 0; x < w; x++) {
+		int x0 = x - r < 0 ? 0 : x - r;
+		int x1 = x + r + 1 > w ? w : x + r + 1;
+		uint32_t sum = row[x1] - row[x0];
+		uint64_t count = (uint64_t)(x1 - x0) * rows;
+
+		// dark if the pixel is `bias` percent darker than the local mean
+		dark[x] = line[x] * count * 100 < (uint64_t)sum * (100 - digitizer->bias);
+	}
+
+	digitizer->write_row(digitizer->dst, y, dark);
+	digitizer->written = y + 1;
+}
+
+// pushes the row y of `src` as the next one, and writes the row r above it
+void image_digitizer_push_row(image_digitizer_t *digitizer, image_view_t *src, int y)
+{
+	int w = digitizer->width;
+	int r = digitizer->r;
+	int gray_rows = 2 * r + 1;
+	int yy = digitizer->pushed;
+
+	// the row on the ring leaves the window
+	image_digitizer_drop_rows(digitizer, yy - gray_rows + 1);
+
+	uint8_t *line = digitizer->gray + (yy % gray_rows) * w;
+	image_gray_row(line, src, y, digitizer->table);
+	for (int x = 0; x < w; x++) digitizer->sums[x] += line[x];
+	digitizer->pushed++;
+
+	if (yy - r >= 0) image_digitizer_write_row(digitizer, yy - r);
+}
+
+// writes the last r rows, as the end of the image
+void image_digitizer_finish(image_digitizer_t *digitizer)
+{
+	while (digitizer->written < digitizer->pushed) image_digitizer_write_row(digitizer, digitizer->written);
+}
+
+// returns 0 if the buffers are not available
+static int image_digitize_adaptive_rows(
+	image_view_t *src, float gamma_value, int window_size, int bias, void (*write_row)(void *dst, int y, const uint8_t *dark), void *dst)
+{
+	int w = src->width;
+	int h = src->height;
+
+	if (window_size <= 0) window_size = (w > h ? w : h) / 8;
+	if (window_size < 3) window_size = 3;
+	int r = window_size / 2;
+
+#ifndef NO_MALLOC
+	uint32_t *sums = (uint32_t *)malloc(sizeof(uint32_t) * IMAGE_DIGITIZER_SUMS_SIZE(w));
+	uint8_t *gray = (uint8_t *)malloc(IMAGE_DIGITIZER_GRAY_SIZE(w, r));
+	if (!sums || !gray) {
+		free(sums);
+		free(gray);
+		return 0;
+	}
+#else
+	// the buffers are on the stack, the window is narrowed to fit in them
+	uint32_t sums[IMAGE_DIGITIZER_MAX_BUFFER_SIZE / sizeof(uint32_t)];
+	while (r > 1 && IMAGE_DIGITIZER_BUFFER_SIZE(w, r) > sizeof(sums)) r--;
+	if (IMAGE_DIGITIZER_BUFFER_SIZE(w, r) > sizeof(sums)) return 0; // too wide
+	uint8_t *gray = (uint8_t *)(sums + IMAGE_DIGITIZER_SUMS_SIZE(w));
+	window_size = 2 * r + 1;
+#endif
+
+	image_digitizer_t digitizer = create_image_digitizer(w, window_size, gamma_value, bias, sums, gray, write_row, dst);
+	for (int y = 0; y < h; y++) image_digitizer_push_row(&digitizer, src, y);
+	image_digitizer_finish(&digitizer);
+
+#ifndef NO_MALLOC
+	free(sums);
+	free(gray);
+#endif
+	return 1;
+}
+
+// falls back to the global threshold if the buffers are not available
+void image_digitize_adaptive(image_t *dst, image_t *src, float gamma_value, int window_size, int bias)
+{
+	image_view_t view = create_image_view_from_image(src);
+	if (!image_digitize_adaptive_rows(&view, gamma_value, window_size, bias, image_write_dark_row, dst)) {
+		image_digitize(dst, src, gamma_value);
+	}
+}
+
+int image_bitmap_digitize_adaptive(image_bitmap_t *dst, image_view_t *src, float gamma_value, int window_size, int bias)
+{
+	if (!image_digitize_adaptive_rows(src, gamma_value, window_size, bias, image_bitmap_write_dark_row, dst)) {
+		return image_bitmap_digitize(dst, src, gamma_value);
+	}
+	return 1;
+}
+
+// returns 0 if the row buffer is not available, with `dst` cleared
+int image_bitmap_digitize(image_bitmap_t *dst, image_view_t *src, float gamma_value)
+{
+	// the gray image is not kept, computing twice is cheaper than storing it
+	size_t hist[256] = { 0 };
+	uint8_t table[256];
+	int w = src->width;
+
+	image_gamma_table(table, gamma_value);
+
+#ifndef NO_MALLOC
+	uint8_t *line = (uint8_t *)malloc(w * 2);
+	if (!line) {
+		image_bitmap_clear(dst);
+		return 0;
+	}
+#else
+	uint8_t line[w * 2];
+#endif
+	uint8_t *dark = line + w;
+
+	for (int y = 0; y < (int)src->height; y++) {
+		image_gray_row(line, src, y, table);
+		for (int x = 0; x < w; x++) {
+			hist[line[x]]++;
+		}
+	}
+
+	uint8_t threshold = image_otsu_threshold(hist);
+
+	for (int y = 0; y < (int)src->height; y++) {
+		image_gray_row(line, src, y, table);
+		for (int x = 0; x < w; x++) {
+			dark[x] = line[x] < threshold;
+		}
+		image_bitmap_write_dark_row(dst, y, dark);
+	}
+
+#ifndef NO_MALLOC
+	free(line);
+#endif
+	return 1;
+}
+
+// box filter by `factor` (2, 4 or 8), a pixel of `dst` is dark if the half or more of the block is dark
+// `dst` is (src->width / factor) x (src->height / factor)
+void image_bitmap_downscale(image_bitmap_t *dst, image_bitmap_t *src, int factor)
+{
+	// SWAR; the blocks are counted in the fields of `factor` bits, then summed up in the ones twice as wide
+	// the even and the odd blocks of a word are in `hi` and `lo`, and never cross the words
+	static const image_bitmap_word_t masks[] = {
+		0, 0x5555555555555555, 0x3333333333333333, 0, 0x0F0F0F0F0F0F0F0F, 0, 0, 0, 0x00FF00FF00FF00FF,
+	};
+	int width = factor * 2;
+	int blocks = IMAGE_BITMAP_WORD_BITS / factor;
+	image_bitmap_word_t ones = ~(image_bitmap_word_t)0 / (((image_bitmap_word_t)1 << width) - 1);
+	image_bitmap_word_t tops = ones << (width - 1);
+	image_bitmap_word_t bias = ones * (((image_bitmap_word_t)1 << (width - 1)) - (factor * factor + 1) / 2);
+
+	for (size_t y = 0; y < dst->height; y++) {
+		image_bitmap_word_t *bits = IMAGE_BITMAP_ROW(dst, y);
+		image_bitmap_word_t *rows = IMAGE_BITMAP_ROW(src, y * factor);
+		memset(bits, 0, dst->stride * sizeof(image_bitmap_word_t));
+
+		for (size_t i = 0, x = 0; i < src->stride && x < dst->width; i++, x += blocks) {
+			image_bitmap_word_t hi = 0, lo = 0;
+			for (int r = 0; r < factor; r++) {
+				image_bitmap_word_t c = rows[r * src->stride + i];
+				for (int n = 1; n < factor; n <<= 1) c = (c & masks[n]) + ((c >> n) & masks[n]);
+				hi += (c >> factor) & masks[factor];
+				lo += c & masks[factor];
+			}
+			// the top bit of the field is set, if it reaches the threshold
+			hi = (hi + bias) & tops;
+			lo = (lo + bias) & tops;
+
+			image_bitmap_word_t word = 0;
+			for (int n = IMAGE_BITMAP_WORD_BITS - 1; n > 0; n -= width) {
+				word = (word << 2) | ((hi >> n) & 1) << 1 | ((lo >> n) & 1);
+			}
+			bits[x / IMAGE_BITMAP_WORD_BITS] |= word << (IMAGE_BITMAP_WORD_BITS - blocks - x % IMAGE_BITMAP_WORD_BITS);
+		}
+
+		// the blocks over the width
+		if (dst->width % IMAGE_BITMAP_WORD_BITS) bits[dst->stride - 1] &= ~(IMAGE_BITMAP_BIT(dst->width - 1) - 1);
+	}
+}
+
+void image_bitmap_pack(image_bitmap_t *dst, image_t *src)
+{
+	for (size_t y = 0; y < src->height; y++) {
+		image_pixel_t *line = src->buffer + y * src->width;
+		image_bitmap_word_t *bits = dst->buffer + y * dst->stride;
+
+		for (size_t i = 0; i < dst->stride; i++) {
+			image_bitmap_word_t word = 0;
+			for (int b = 0; b < IMAGE_BITMAP_WORD_BITS; b++) {
+				size_t x = i * IMAGE_BITMAP_WORD_BITS + b;
+				word = (word << 1) | (x < src->width && (line[x] & PIXEL_MASK) == 0 ? 1 : 0);
+			}
+			bits[i] = word;
+		}
+	}
+}
+
+void image_bitmap_unpack(image_t *dst, image_bitmap_t *src)
+{
+	for (size_t y = 0; y < src->height; y++) {
+		image_pixel_t *line = dst->buffer + y * dst->width;
+		image_bitmap_word_t *bits = src->buffer + y * src->stride;
+
+		for (size_t x = 0; x < src->width; x++) {
+			bit_t v = (bits[x / IMAGE_BITMAP_WORD_BITS] & IMAGE_BITMAP_BIT(x)) ? 1 : 0;
+			line[x] = (v ? PIXEL(0, 0, 0) : PIXEL(255, 255, 255)) | ~PIXEL_MASK;
 		}
 	}
 }
@@ -413,109 +1294,195 @@ image_point_t image_point_transform(image_point_t p, image_transform_matrix_t ma
 	return POINT((x / w), (y / w));
 }
 
-image_transform_matrix_t create_image_transform_matrix(image_point_t src[4], image_point_t dst[4])
+static void image_transform_iterator_renormalize(image_transform_iterator_t *it)
 {
-	float src_x0 = POINT_X(src[0]);
-	float src_y0 = POINT_Y(src[0]);
-	float src_x1 = POINT_X(src[1]);
-	float src_y1 = POINT_Y(src[1]);
-	float src_x2 = POINT_X(src[2]);
-	float src_y2 = POINT_Y(src[2]);
-	float src_x3 = POINT_X(src[3]);
-	float src_y3 = POINT_Y(src[3]);
-
-	float dst_x0 = POINT_X(dst[0]);
-	float dst_y0 = POINT_Y(dst[0]);
-	float dst_x1 = POINT_X(dst[1]);
-	float dst_y1 = POINT_Y(dst[1]);
-	float dst_x2 = POINT_X(dst[2]);
-	float dst_y2 = POINT_Y(dst[2]);
-	float dst_x3 = POINT_X(dst[3]);
-	float dst_y3 = POINT_Y(dst[3]);
-
-	float a[8][8] = {
-		{src_x0, src_y0, 1,      0,      0, 0, -src_x0 * dst_x0, -src_y0 * dst_x0},
-		{     0,      0, 0, src_x0, src_y0, 1, -src_x0 * dst_y0, -src_y0 * dst_y0},
-		{src_x1, src_y1, 1,      0,      0, 0, -src_x1 * dst_x1, -src_y1 * dst_x1},
-		{     0,      0, 0, src_x1, src_y1, 1, -src_x1 * dst_y1, -src_y1 * dst_y1},
-		{src_x2, src_y2, 1,      0,      0, 0, -src_x2 * dst_x2, -src_y2 * dst_x2},
-		{     0,      0, 0, src_x2, src_y2, 1, -src_x2 * dst_y2, -src_y2 * dst_y2},
-		{src_x3, src_y3, 1,      0,      0, 0, -src_x3 * dst_x3, -src_y3 * dst_x3},
-		{     0,      0, 0, src_x3, src_y3, 1, -src_x3 * dst_y3, -src_y3 * dst_y3},
-	};
-	float b[8] = {
-		dst_x0,
-		dst_y0,
-		dst_x1,
-		dst_y1,
-		dst_x2,
-		dst_y2,
-		dst_x3,
-		dst_y3,
+	float px = POINT_X(it->origin) + POINT_X(it->step) * it->index;
+	float py = POINT_Y(it->origin) + POINT_Y(it->step) * it->index;
+
+	it->x = it->matrix.m[0] * px + it->matrix.m[1] * py + it->matrix.m[2];
+	it->y = it->matrix.m[3] * px + it->matrix.m[4] * py + it->matrix.m[5];
+	it->w = it->matrix.m[6] * px + it->matrix.m[7] * py + 1.0;
+}
+
+image_transform_iterator_t create_image_transform_iterator(image_transform_matrix_t matrix, image_point_t origin, image_point_t step)
+{
+	image_transform_iterator_t it = {
+		.matrix = matrix,
+		.origin = origin,
+		.step = step,
+		.dx = matrix.m[0] * POINT_X(step) + matrix.m[1] * POINT_Y(step),
+		.dy = matrix.m[3] * POINT_X(step) + matrix.m[4] * POINT_Y(step),
+		.dw = matrix.m[6] * POINT_X(step) + matrix.m[7] * POINT_Y(step),
 	};
+	image_transform_iterator_renormalize(&it);
+	return it;
+}
 
-	// Gauss-Jordan elimination
-	for (int i = 0; i < 8; i++) {
-		int pivot = i;
-		for (int j = i + 1; j < 8; j++) {
-			if (fabs(a[j][i]) > fabs(a[pivot][i])) {
-				pivot = j;
-			}
-		}
+// returns the current point, and steps forward
+image_point_t image_transform_iterator_next(image_transform_iterator_t *it)
+{
+	image_point_t p = POINT(it->x / it->w, it->y / it->w);
+
+	if (++it->index % IMAGE_TRANSFORM_ITERATOR_RENORMALIZE == 0) {
+		image_transform_iterator_renormalize(it);
+	} else {
+		it->x += it->dx;
+		it->y += it->dy;
+		it->w += it->dw;
+	}
 
-		for (int j = 0; j < 8; j++) {
-			float tmp = a[i][j];
-			a[i][j] = a[pivot][j];
-			a[pivot][j] = tmp;
-		}
-		{
-			float tmp = b[i];
-			b[i] = b[pivot];
-			b[pivot] = tmp;
-		}
+	return p;
+}
 
-		for (int j = i + 1; j < 8; j++) {
-			float ratio = a[j][i] / a[i][i];
-			for (int k = i; k < 8; k++) {
-				a[j][k] -= a[i][k] * ratio;
-			}
-			b[j] -= b[i] * ratio;
-		}
+// same as calling next for the lanes, the loops over the lanes are vectorized by the compiler at -O3
+// the lanes are offset from the current terms, which step over the lanes at once as next does
+void image_transform_iterator_next_lanes(image_transform_iterator_t *it, image_point_t points[IMAGE_TRANSFORM_ITERATOR_LANES])
+{
+	float x[IMAGE_TRANSFORM_ITERATOR_LANES];
+	float y[IMAGE_TRANSFORM_ITERATOR_LANES];
+	float w[IMAGE_TRANSFORM_ITERATOR_LANES];
+
+	for (int i = 0; i < IMAGE_TRANSFORM_ITERATOR_LANES; i++) {
+		x[i] = it->x + it->dx * i;
+		y[i] = it->y + it->dy * i;
+		w[i] = it->w + it->dw * i;
+	}
+	// a division per point is left, as the transform is projective
+	for (int i = 0; i < IMAGE_TRANSFORM_ITERATOR_LANES; i++) {
+		float r = 1.0f / w[i];
+		points[i].x = x[i] * r;
+		points[i].y = y[i] * r;
+	}
+
+	int from = it->index;
+	it->index += IMAGE_TRANSFORM_ITERATOR_LANES;
+	if (from / IMAGE_TRANSFORM_ITERATOR_RENORMALIZE != it->index / IMAGE_TRANSFORM_ITERATOR_RENORMALIZE) {
+		image_transform_iterator_renormalize(it);
+	} else {
+		it->x += it->dx * IMAGE_TRANSFORM_ITERATOR_LANES;
+		it->y += it->dy * IMAGE_TRANSFORM_ITERATOR_LANES;
+		it->w += it->dw * IMAGE_TRANSFORM_ITERATOR_LANES;
 	}
+}
 
-	for (int i = 7; i >= 0; i--) {
-		for (int j = i + 1; j < 8; j++) {
-			b[i] -= a[i][j] * b[j];
+// 3x3 matrices in row major, for composing the transforms
+static void image_transform_multiply(float r[9], const float a[9], const float b[9])
+{
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			r[i * 3 + j] = a[i * 3 + 0] * b[0 * 3 + j] + a[i * 3 + 1] * b[1 * 3 + j] + a[i * 3 + 2] * b[2 * 3 + j];
 		}
-		b[i] /= a[i][i];
 	}
+}
+
+// unit square (0, 0), (1, 0), (1, 1), (0, 1) to the quad, in closed form (Heckbert)
+// returns 0 if the quad is degenerate
+static int image_transform_square_to_quad(float m[9], image_point_t q[4])
+{
+	float x0 = POINT_X(q[0]), y0 = POINT_Y(q[0]);
+	float x1 = POINT_X(q[1]), y1 = POINT_Y(q[1]);
+	float x2 = POINT_X(q[2]), y2 = POINT_Y(q[2]);
+	float x3 = POINT_X(q[3]), y3 = POINT_Y(q[3]);
+
+	float sx = x0 - x1 + x2 - x3;
+	float sy = y0 - y1 + y2 - y3;
+	float g = 0, h = 0;
+
+	if (sx != 0 || sy != 0) {
+		float dx1 = x1 - x2, dx2 = x3 - x2;
+		float dy1 = y1 - y2, dy2 = y3 - y2;
+		float den = dx1 * dy2 - dx2 * dy1;
+		if (den == 0) return 0;
+
+		g = (sx * dy2 - dx2 * sy) / den;
+		h = (dx1 * sy - sx * dy1) / den;
+	}
+
+	m[0] = x1 - x0 + g * x1;
+	m[1] = x3 - x0 + h * x3;
+	m[2] = x0;
+	m[3] = y1 - y0 + g * y1;
+	m[4] = y3 - y0 + h * y3;
+	m[5] = y0;
+	m[6] = g;
+	m[7] = h;
+	m[8] = 1;
+
+	// the corners must not collapse
+	float det = m[0] * (m[4] * m[8] - m[5] * m[7]) - m[1] * (m[3] * m[8] - m[5] * m[6]) + m[2] * (m[3] * m[7] - m[4] * m[6]);
+	return det != 0 && isfinite(det);
+}
 
+// all NaN if the points are degenerate
+image_transform_matrix_t create_image_transform_matrix(image_point_t src[4], image_point_t dst[4])
+{
 	image_transform_matrix_t matrix = {
-		.m = {b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]},
+		.m = {NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN},
 	};
 
+	float sq2dst[9];
+	if (!image_transform_square_to_quad(sq2dst, dst)) return matrix;
+
+	float src2sq[9];
+	float w = POINT_X(src[1]) - POINT_X(src[0]);
+	float h = POINT_Y(src[3]) - POINT_Y(src[0]);
+	if (POINT_Y(src[0]) == POINT_Y(src[1]) && POINT_X(src[1]) == POINT_X(src[2]) && POINT_Y(src[2]) == POINT_Y(src[3])
+		&& POINT_X(src[3]) == POINT_X(src[0]) && w != 0 && h != 0) {
+		// fast path: an axis-aligned rectangle is just scaled and translated to the square
+		float m[9] = {
+			1 / w, 0, -POINT_X(src[0]) / w, //
+			0, 1 / h, -POINT_Y(src[0]) / h, //
+			0, 0, 1, //
+		};
+		memcpy(src2sq, m, sizeof(m));
+	} else {
+		// inverse of the square to the src, by the adjugate, as the scale doesn't matter
+		float a[9];
+		if (!image_transform_square_to_quad(a, src)) return matrix;
+
+		src2sq[0] = a[4] * a[8] - a[5] * a[7];
+		src2sq[1] = a[2] * a[7] - a[1] * a[8];
+		src2sq[2] = a[1] * a[5] - a[2] * a[4];
+		src2sq[3] = a[5] * a[6] - a[3] * a[8];
+		src2sq[4] = a[0] * a[8] - a[2] * a[6];
+		src2sq[5] = a[2] * a[3] - a[0] * a[5];
+		src2sq[6] = a[3] * a[7] - a[4] * a[6];
+		src2sq[7] = a[1] * a[6] - a[0] * a[7];
+		src2sq[8] = a[0] * a[4] - a[1] * a[3];
+	}
+
+	float r[9];
+	image_transform_multiply(r, sq2dst, src2sq);
+	if (r[8] == 0) return matrix;
+
+	for (int i = 0; i < 8; i++) matrix.m[i] = r[i] / r[8];
+
 	return matrix;
 }
 
+// returns 1 if any of the 8 neighbors matches, the outside is ignored
+static int image_morphology_any_neighbor(image_t *img, int x, int y, int dark)
+{
+	for (int dy = -1; dy <= 1; dy++) {
+		if (y + dy < 0 || y + dy >= (int)img->height) continue;
+
+		image_pixel_t *row = IMAGE_ROW(img, y + dy);
+		for (int dx = -1; dx <= 1; dx++) {
+			if (dx == 0 && dy == 0) continue;
+			if (x + dx < 0 || x + dx >= (int)img->width) continue;
+			if (((row[x + dx] & PIXEL_MASK) == 0) == dark) return 1;
+		}
+	}
+	return 0;
+}
+
 void image_morphology_erode(image_t *dst)
 {
 	CREATE_IMAGE_BY_CLONE(src, dst);
 	for (int y = 0; y < (int)src.height; y++) {
 		for (int x = 0; x < (int)src.width; x++) {
-			image_pixel_t pix = image_read_pixel(&src, POINT(x, y));
-			if (pix == 0) continue;
-
-			for (int dy = -1; dy <= 1; dy++) {
-				for (int dx = -1; dx <= 1; dx++) {
-					if (dx == 0 && dy == 0) continue;
-					if (x + dx < 0 || y + dy < 0 || x + dx >= (int)src.width || y + dy >= (int)src.height) continue;
-					if (image_read_pixel(&src, POINT(x + dx, y + dy)) == 0) {
-						image_draw_pixel(dst, POINT(x, y), 0);
-						goto next;
-					}
-				}
-			}
-		next:;
+			if (IMAGE_READ_PIXEL(&src, x, y) == 0) continue;
+			if (image_morphology_any_neighbor(&src, x, y, 1)) IMAGE_DRAW_PIXEL(dst, x, y, 0);
 		}
 	}
 	DESTROY_IMAGE(src);
@@ -526,20 +1493,8 @@ void image_morphology_dilate(image_t *dst)
 	CREATE_IMAGE_BY_CLONE(src, dst);
 	for (int y = 0; y < (int)src.height; y++) {
 		for (int x = 0; x < (int)src.width; x++) {
-			image_pixel_t pix = image_read_pixel(&src, POINT(x, y));
-			if (pix != 0) continue;
-
-			for (int dy = -1; dy <= 1; dy++) {
-				for (int dx = -1; dx <= 1; dx++) {
-					if (dx == 0 && dy == 0) continue;
-					if (x + dx < 0 || y + dy < 0 || x + dx >= (int)src.width || y + dy >= (int)src.height) continue;
-					if (image_read_pixel(&src, POINT(x + dx, y + dy)) != 0) {
-						image_draw_pixel(dst, POINT(x, y), PIXEL(255, 255, 255));
-						goto next;
-					}
-				}
-			}
-		next:;
+			if (IMAGE_READ_PIXEL(&src, x, y) != 0) continue;
+			if (image_morphology_any_neighbor(&src, x, y, 0)) IMAGE_DRAW_PIXEL(dst, x, y, PIXEL(255, 255, 255));
 		}
 	}
 	DESTROY_IMAGE(src);
@@ -20,6 +20,25 @@ typedef struct {
 	image_pixel_t *buffer;
 } image_t;
 
+// image_view_t: read-only view of a caller's buffer, without copying
+typedef enum {
+	IMAGE_FORMAT_PIXEL, // image_pixel_t
+	IMAGE_FORMAT_GRAY8,
+	IMAGE_FORMAT_RGB24,
+	IMAGE_FORMAT_RGBA32,
+	IMAGE_FORMAT_BGRA32,
+	IMAGE_FORMAT_YUV_Y, // Y plane of YUV (I420, NV12, ...)
+} image_format_t;
+
+typedef struct {
+	size_t width;
+	size_t height;
+	size_t stride; // in bytes
+	image_format_t format;
+
+	const void *buffer;
+} image_view_t;
+
 typedef struct {
 	float top;
 	float right;
@@ -30,8 +49,25 @@ typedef struct {
 typedef struct {
 	image_extent_t extent;
 	int area;
+	int truncated; // stopped by the area limit, or by the stack limit
 } image_paint_result_t;
 
+// work stack for the flood fill, to paint without recursion
+typedef struct {
+	int lx;
+	int rx;
+	int y;
+} image_paint_span_t;
+
+typedef struct {
+	image_paint_span_t *spans;
+	size_t size;
+	int growable; // `spans` is on the heap, and is reallocated if needed
+} image_paint_stack_t;
+
+// the default stack grows on the heap if needed, a given one grows only if it's growable
+#define IMAGE_PAINT_DEFAULT_STACK_SIZE (256)
+
 typedef struct {
 	/*
 	 *  m0 m1 m2
@@ -54,6 +90,11 @@ void image_buffer_free(image_pixel_t *buffer);
 // internal
 void image_init(image_t *img, size_t width, size_t height, void *buffer);
 
+// stride 0 means tightly packed
+image_view_t create_image_view(size_t width, size_t height, size_t stride, image_format_t format, const void *buffer);
+image_view_t create_image_view_from_image(image_t *img);
+size_t image_format_get_bytes_per_pixel(image_format_t format);
+
 #ifdef NO_MALLOC
 // stack version
 #define CREATE_IMAGE(name, width, height) \
@@ -75,6 +116,19 @@ void image_init(image_t *img, size_t width, size_t height, void *buffer);
 	image_copy(&name, src);
 
 
+// integer accessors without the bounds checks, for the loops which validate the bounds once per row
+// define USE_BOUNDS_CHECK to assert them anyway
+#ifdef USE_BOUNDS_CHECK
+#include <assert.h>
+#define IMAGE_ASSERT_BOUNDS(img, x, y) assert(0 <= (x) && (x) < (int)(img)->width && 0 <= (y) && (y) < (int)(img)->height)
+#else
+#define IMAGE_ASSERT_BOUNDS(img, x, y) ((void)0)
+#endif
+
+#define IMAGE_ROW(img, y)                 ((img)->buffer + (size_t)(y) * (img)->width)
+#define IMAGE_READ_PIXEL(img, x, y)       (IMAGE_ASSERT_BOUNDS(img, x, y), IMAGE_ROW(img, y)[x] & PIXEL_MASK)
+#define IMAGE_DRAW_PIXEL(img, x, y, pixel) (IMAGE_ASSERT_BOUNDS(img, x, y), IMAGE_ROW(img, y)[x] = (image_pixel_t)((pixel) | ~PIXEL_MASK))
+
 // image_point_t
 typedef struct {
 	float x;
@@ -105,6 +159,7 @@ image_point_t image_extent_center(image_extent_t *extent);
 
 void image_extent_dump(image_extent_t *extent);
 image_paint_result_t image_paint(image_t *img, image_point_t p, image_pixel_t pix);
+image_paint_result_t image_paint_bounded(image_t *img, image_point_t p, image_pixel_t pix, image_paint_stack_t *stack, int max_area);
 float image_point_norm(image_point_t a);
 float image_point_distance(image_point_t a, image_point_t b);
 float image_point_angle(image_point_t base, image_point_t p);
@@ -113,9 +168,140 @@ void image_draw_extent(image_t *img, image_extent_t extent, image_pixel_t pix, i
 image_point_t image_point_transform(image_point_t p, image_transform_matrix_t matrix);
 image_transform_matrix_t create_image_transform_matrix(image_point_t src[4], image_point_t dst[4]);
 
+// walks along a line of the source space, updating the terms of the transform incrementally
+#define IMAGE_TRANSFORM_ITERATOR_LANES       (8) // points at once, for the vectorized variant
+#define IMAGE_TRANSFORM_ITERATOR_RENORMALIZE (32) // steps to recompute the terms, to bound the error
+
+typedef struct {
+	image_transform_matrix_t matrix;
+	image_point_t origin;
+	image_point_t step;
+	int index; // steps from the origin
+
+	// numerators and denominator at the current step, and their differences
+	float x, y, w;
+	float dx, dy, dw;
+} image_transform_iterator_t;
+
+image_transform_iterator_t create_image_transform_iterator(image_transform_matrix_t matrix, image_point_t origin, image_point_t step);
+image_point_t image_transform_iterator_next(image_transform_iterator_t *it);
+void image_transform_iterator_next_lanes(image_transform_iterator_t *it, image_point_t points[IMAGE_TRANSFORM_ITERATOR_LANES]);
+
+// default parameters for image_digitize_adaptive
+// the pixel is dark if it's `bias` percent darker than the local mean, the bias is clamped to 0-100
+#define IMAGE_DIGITIZE_ADAPTIVE_WINDOW_AUTO (0)
+#define IMAGE_DIGITIZE_ADAPTIVE_BIAS        (15)
+
 void image_digitize(image_t *dst, image_t *src, float gamma_value);
+void image_digitize_adaptive(image_t *dst, image_t *src, float gamma_value, int window_size, int bias);
 void image_monochrome(image_t *dst, image_t *src, float gamma_value, size_t hist_result[256]);
 
+// image_bitmap_t: 1 bit per pixel binary image, the bit is set for dark pixels
+typedef uint64_t image_bitmap_word_t;
+#define IMAGE_BITMAP_WORD_BITS    (64)
+#define IMAGE_BITMAP_STRIDE(width) (((width) + IMAGE_BITMAP_WORD_BITS - 1) / IMAGE_BITMAP_WORD_BITS)
+#define IMAGE_BITMAP_BIT(x)        ((image_bitmap_word_t)1 << (IMAGE_BITMAP_WORD_BITS - 1 - (x) % IMAGE_BITMAP_WORD_BITS))
+
+typedef struct {
+	size_t width;
+	size_t height;
+	size_t stride; // in words
+
+	image_bitmap_word_t *buffer; // MSB first
+} image_bitmap_t;
+
+#define IMAGE_BITMAP_ROW(bmp, y) ((bmp)->buffer + (size_t)(y) * (bmp)->stride)
+#define IMAGE_BITMAP_READ_PIXEL(bmp, x, y) \
+	(IMAGE_ASSERT_BOUNDS(bmp, x, y), (IMAGE_BITMAP_ROW(bmp, y)[(x) / IMAGE_BITMAP_WORD_BITS] & IMAGE_BITMAP_BIT(x)) ? 1 : 0)
+
+image_bitmap_t create_image_bitmap(size_t width, size_t height, void *buffer);
+image_bitmap_t *image_bitmap_copy(image_bitmap_t *dst, image_bitmap_t *src);
+
+// malloc version
+image_bitmap_t *new_image_bitmap(size_t width, size_t height);
+void image_bitmap_free(image_bitmap_t *bmp);
+image_bitmap_t *image_bitmap_clone(image_bitmap_t *bmp);
+image_bitmap_word_t *new_image_bitmap_buffer(size_t width, size_t height);
+void image_bitmap_buffer_free(image_bitmap_word_t *buffer);
+
+// internal
+void image_bitmap_init(image_bitmap_t *bmp, size_t width, size_t height, void *buffer);
+
+#ifdef NO_MALLOC
+// stack version
+#define CREATE_IMAGE_BITMAP(name, width, height) \
+	image_bitmap_word_t _##name##__buffer[IMAGE_BITMAP_STRIDE(width) * (height)]; \
+	memset(_##name##__buffer, 0, sizeof(_##name##__buffer)); \
+	image_bitmap_t name = create_image_bitmap((width), (height), _##name##__buffer);
+
+#define DESTROY_IMAGE_BITMAP(name) (void)(name);
+#else
+// malloc version
+#define CREATE_IMAGE_BITMAP(name, width, height) \
+	image_bitmap_word_t *_##name##__buffer = new_image_bitmap_buffer(width, height); \
+	image_bitmap_t name = create_image_bitmap((width), (height), _##name##__buffer);
+
+#define DESTROY_IMAGE_BITMAP(name) image_bitmap_buffer_free(_##name##__buffer);
+#endif
+#define CREATE_IMAGE_BITMAP_BY_CLONE(name, src) \
+	CREATE_IMAGE_BITMAP(name, (src)->width, (src)->height); \
+	image_bitmap_copy(&name, src);
+
+void image_bitmap_clear(image_bitmap_t *bmp);
+void image_bitmap_clear_extent(image_bitmap_t *bmp, image_extent_t extent);
+void image_bitmap_draw_pixel(image_bitmap_t *bmp, image_point_t p, bit_t v);
+bit_t image_bitmap_read_pixel(image_bitmap_t *bmp, image_point_t p);
+int image_bitmap_next_edge(image_bitmap_t *bmp, image_bitmap_t *mask, int x, int y);
+image_paint_result_t image_bitmap_paint(image_bitmap_t *mask, image_bitmap_t *bmp, image_point_t p, bit_t v);
+image_paint_result_t image_bitmap_paint_bounded(
+	image_bitmap_t *mask, image_bitmap_t *bmp, image_point_t p, bit_t v, image_paint_stack_t *stack, int max_area);
+int image_bitmap_trace_boundary(image_bitmap_t *mask, int x, int y, void (*on_point)(void *opaque, int x, int y), void *opaque);
+
+void image_bitmap_downscale(image_bitmap_t *dst, image_bitmap_t *src, int factor);
+void image_bitmap_pack(image_bitmap_t *dst, image_t *src);
+void image_bitmap_unpack(image_t *dst, image_bitmap_t *src);
+// returns 0 if the buffers are not available, `dst` is cleared then
+int image_bitmap_digitize(image_bitmap_t *dst, image_view_t *src, float gamma_value);
+int image_bitmap_digitize_adaptive(image_bitmap_t *dst, image_view_t *src, float gamma_value, int window_size, int bias);
+
+// digitizes the rows as they come, as image_bitmap_digitize_adaptive does
+// only the rows around the window are kept, and the row y is written once the row y + r is pushed
+typedef struct {
+	size_t width;
+	int r; // of the window
+	int bias;
+	uint8_t table[256];
+
+	uint32_t *sums; // of the columns over the rows in the window, and the running sum of them along the row
+	uint8_t *gray; // gray rows in the ring, and the dark row
+	int pushed;
+	int written;
+	int dropped; // from the sums
+
+	void (*write_row)(void *dst, int y, const uint8_t *dark);
+	void *dst;
+} image_digitizer_t;
+
+#define IMAGE_DIGITIZER_SUMS_SIZE(width)    ((size_t)2 * (width) + 1)
+#define IMAGE_DIGITIZER_GRAY_SIZE(width, r) ((size_t)(2 * (r) + 2) * (width))
+#define IMAGE_DIGITIZER_BUFFER_SIZE(width, r) \
+	(IMAGE_DIGITIZER_SUMS_SIZE(width) * sizeof(uint32_t) + IMAGE_DIGITIZER_GRAY_SIZE(width, r))
+#define IMAGE_DIGITIZER_MAX_BUFFER_SIZE (64 * 1024) // the window is narrowed to fit in it, without malloc
+
+image_digitizer_t create_image_digitizer(size_t width, int window_size, float gamma_value, int bias, uint32_t *sums, uint8_t *gray,
+	void (*write_row)(void *dst, int y, const uint8_t *dark), void *dst);
+
+// malloc version
+image_digitizer_t *new_image_digitizer(size_t width, int window_size, float gamma_value, int bias,
+	void (*write_row)(void *dst, int y, const uint8_t *dark), void *dst);
+void image_digitizer_free(image_digitizer_t *digitizer);
+
+void image_digitizer_push_row(image_digitizer_t *digitizer, image_view_t *src, int y);
+void image_digitizer_finish(image_digitizer_t *digitizer);
+
+// writes the dark row to the bitmap `dst`, for the digitizer
+void image_bitmap_write_dark_row(void *dst, int y, const uint8_t *dark);
+
 void image_morphology_erode(image_t *img);
 void image_morphology_dilate(image_t *img);
 void image_morphology_close(image_t *img);
@@ -25,6 +25,33 @@ check_contains() {
 	fi
 }
 
+# the same symbols as detected at once
+check_same() {
+	file=$1
+	shift
+	echo -n "  $* $file ... "
+	if [ "$(${QREAN_DETECT} "$file")" = "$(${QREAN_DETECT} "$@" "$file")" ]; then
+		printf "\033[32mPASS\033[m\n"
+	else
+		printf "\033[31mFAILED\033[m\n"
+		error=1
+	fi
+}
+
+# the same bitmap, with the marks on it, as digitized from the image as is
+check_same_bitmap() {
+	format=$1
+	file=$2
+	shift 2
+	echo -n "  -F $format${*:+ $*} $file ... "
+	if [ "$(${QREAN_DETECT} -D "$@" "$file" 2>/dev/null | cksum)" = "$(${QREAN_DETECT} -D "$@" -F "$format" "$file" 2>/dev/null | cksum)" ]; then
+		printf "\033[32mPASS\033[m\n"
+	else
+		printf "\033[31mFAILED\033[m\n"
+		error=1
+	fi
+}
+
 echo "Generation:"
 ${QREAN} -t qr   -f txt -l L -8 -p 4 -p 4 "Hello" | check - qr-1.txt
 ${QREAN} -t mqr  -f txt -l L -8 -m 1 -p 2 "test"  | check - mqr-1.txt
@@ -37,6 +64,69 @@ ${QREAN_DETECT} github-libqrean-qr.png | check_contains - github-libqrean-qr.txt
 ${QREAN_DETECT} PXL_20240109_050512422.png | check_contains - PXL_20240109_050512422.txt
 ${QREAN_DETECT} PXL_20240109_050512422_lr.png | check_contains - PXL_20240109_050512422_lr.txt
 ${QREAN_DETECT} PXL_20240109_050512422_r90.png | check_contains - PXL_20240109_050512422_r90.txt
+${QREAN_DETECT} mqr-triple.png | check_contains - mqr-triple.txt
+${QREAN_DETECT} -P 2 github-libqrean-qr.png | check_contains - github-libqrean-qr.txt
+${QREAN} -t qr -s 3 "Pyramid" | ${QREAN_DETECT} -P 2 | check_contains - qr-pyramid.txt
+${QREAN} -t qr -s 24 "Pyramid" | ${QREAN_DETECT} -P 2 | check_contains - qr-pyramid.txt
+${QREAN} -t qr -s 24 "Pyramid" | ${QREAN_DETECT} -P -1 | check_contains - qr-pyramid.txt
+${QREAN_DETECT} qr-grid.png | sort | check - qr-grid.txt
+
+echo "Detection (adaptive):"
+${QREAN_DETECT} -A github-libqrean-qr.png | check_contains - github-libqrean-qr.txt
+${QREAN_DETECT} -A PXL_20240109_050512422.png | check_contains - PXL_20240109_050512422.txt
+${QREAN_DETECT} -A qr-uneven-lighting.png | check_contains - qr-uneven-lighting.txt
+
+echo "Detection (labeling):"
+${QREAN_DETECT} -L github-libqrean-qr.png | check_contains - github-libqrean-qr.txt
+${QREAN_DETECT} -L PXL_20240109_050512422.png | check_contains - PXL_20240109_050512422.txt
+${QREAN_DETECT} -L PXL_20240109_050512422_r90.png | check_contains - PXL_20240109_050512422_r90.txt
+${QREAN_DETECT} -L -A qr-uneven-lighting.png | check_contains - qr-uneven-lighting.txt
+
+echo "Digitization (formats):"
+check_same_bitmap gray8 PXL_20240109_050512422.png
+check_same_bitmap yuv-y PXL_20240109_050512422.png
+check_same_bitmap rgb24 PXL_20240109_050512422.png
+check_same_bitmap rgba32 PXL_20240109_050512422.png
+check_same_bitmap bgra32 PXL_20240109_050512422.png
+check_same_bitmap gray8 qr-uneven-lighting.png -A
+check_same_bitmap bgra32 qr-uneven-lighting.png -A
+
+echo "Detection (stream):"
+${QREAN_DETECT} -s 512 github-libqrean-qr.png | check_contains - github-libqrean-qr.txt
+${QREAN_DETECT} -s 256 qr-uneven-lighting.png | check_contains - qr-uneven-lighting.txt
+${QREAN_DETECT} -s 256 PXL_20240109_050512422.png | check_contains - PXL_20240109_050512422.txt
+${QREAN} -t qr -s 4 "Pyramid" | ${QREAN_DETECT} -s 128 | check - qr-pyramid.txt
+${QREAN} -t ean13 $(cat ean13.txt) | ${QREAN_DETECT} -s 64 | check - ean13.txt
+${QREAN_DETECT} -s 400 qr-hello-world.png | check - qr-hello-world.txt
+
+echo "Detection (steps):"
+check_same github-libqrean-qr.png -W 1
+check_same PXL_20240109_050512422.png -W 1
+check_same PXL_20240109_050512422.png -W 16
+check_same PXL_20240109_050512422_r90.png -W 4
+check_same mqr-triple.png -W 1
+
+echo "Detection (tracker):"
+${QREAN_DETECT} -T 3 github-libqrean-qr.png | check - tracker-qr.txt
+${QREAN_DETECT} -T 3 -v PXL_20240109_050512422.png | check - tracker-barcode.txt
+${QREAN_DETECT} -T 2 ean13-stacked.png | check - tracker-stacked.txt
+
+echo "Barcode:"
+${QREAN} -t ean13 4901234567894 | ${QREAN_DETECT} -v | check - barcode-ean13.txt
+${QREAN} -t ean8 49123456 | ${QREAN_DETECT} -v | check - barcode-ean8.txt
+${QREAN} -t upca 012345678905 | ${QREAN_DETECT} -v | check - barcode-upca.txt
+${QREAN} -t code39 ABC-123 | ${QREAN_DETECT} -v | check - barcode-code39.txt
+${QREAN} -t code93 ABC-123 | ${QREAN_DETECT} -v | check - barcode-code93.txt
+${QREAN} -t itf 1234567890 | ${QREAN_DETECT} -v | check - barcode-itf.txt
+${QREAN} -t nw7 A123456B | ${QREAN_DETECT} -v | check - barcode-nw7.txt
+
+echo "Barcode (quiet zone):"
+${QREAN} -t ean13 -p 4,11,4,7 $(cat ean13.txt) | ${QREAN_DETECT} | check - ean13.txt
+${QREAN} -t ean13 -p 4,7,4,7 $(cat ean13.txt) | ${QREAN_DETECT} | check - ean13.txt
+${QREAN} -t ean8 -p 4,11,4,3 $(cat ean8.txt) | ${QREAN_DETECT} | check - ean8.txt
+${QREAN} -t upca -p 4,10,4,5 $(cat upca.txt) | ${QREAN_DETECT} | check_contains - upca.txt
+${QREAN} -t itf -p 4,10,4,3 $(cat itf.txt) | ${QREAN_DETECT} | check - itf.txt
+${QREAN} -t itf -p 4,7,4,7 $(cat itf.txt) | ${QREAN_DETECT} | check - itf.txt
 
 echo "Kanji:"
 ${QREAN} -UK $(cat kanji.txt) | ${QREAN_DETECT} | check - kanji.txt
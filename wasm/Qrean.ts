@@ -32,6 +32,7 @@ type EncodeOptions = {
 
 type DetectOptions = {
   gamma?: number;
+  binarization?: 'otsu' | 'adaptive';
   eciCode?: 'UTF-8' | 'ShiftJIS' | 'Latin1';
   outbufSize?: number;
 };
@@ -489,6 +490,7 @@ export class Qrean {
       image_ptr,
       gamma_value,
       Qrean.QR_ECI_CODES[opts.eciCode ?? Qrean.QR_ECI_CODE_LATIN1],
+      opts.binarization === 'adaptive' ? 1 : 0,
     );
 
     this.on_found = undefined;
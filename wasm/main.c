@@ -105,27 +105,31 @@ static void on_found(qrean_detector_perspective_t *warp, void *opaque) {
 	);
 }
 
-int detect(char *outputbuf, unsigned int size, image_t *img, double gamma_value, int eci_code) {
+int detect(char *outputbuf, unsigned int size, image_t *img, double gamma_value, int eci_code, int adaptive) {
 	outputbuf[0] = '\0';
 
-	// overwrite. it's safe with src == dst
-	image_digitize(img, img, gamma_value);
+	image_view_t view = create_image_view_from_image(img);
+	CREATE_IMAGE_BITMAP(bitmap, img->width, img->height);
+	CREATE_QREAN_DETECTOR(detector, img->width, img->height);
+	if (adaptive) {
+		image_bitmap_digitize_adaptive(&bitmap, &view, gamma_value, IMAGE_DIGITIZE_ADAPTIVE_WINDOW_AUTO, IMAGE_DIGITIZE_ADAPTIVE_BIAS);
+	} else {
+		image_bitmap_digitize(&bitmap, &view, gamma_value);
+	}
 	int found = 0;
 
-	int num_candidates = 0;
-	qrean_detector_qr_finder_candidate_t* candidates = qrean_detector_scan_qr_finder_pattern(img, &num_candidates);
-
 	on_found_params_t params = {
 		outputbuf,
 		size,
 		eci_code,
 	};
 
-	found += qrean_detector_try_decode_qr(img, candidates, num_candidates, on_found, &params);
-	found += qrean_detector_try_decode_mqr(img, candidates, num_candidates, on_found, &params);
-	found += qrean_detector_try_decode_rmqr(img, candidates, num_candidates, on_found, &params);
-	found += qrean_detector_try_decode_tqr(img, candidates, num_candidates, on_found, &params);
-	found += qrean_detector_scan_barcodes(img, on_found, &params);
+	found += qrean_detector_detect(&detector, &bitmap, on_found, &params);
+
+	// overwrite with the digitized one, for the caller
+	image_bitmap_unpack(img, &bitmap);
+	DESTROY_QREAN_DETECTOR(detector);
+	DESTROY_IMAGE_BITMAP(bitmap);
 
 	return found;
 }